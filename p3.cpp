@@ -1,45 +1,114 @@
 #include <fstream>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <mutex>
+#include <tuple>
+#include <map>
+#include <sstream>
+#include <chrono>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "llvm-c/Core.h"
 
+#include "llvm/Config/llvm-config.h"
+
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/ADT/StringSet.h"
-#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/LinkAllPasses.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/LoopAccessAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallBitVector.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/GlobalsModRef.h"
+#include "llvm/Analysis/Loads.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScopedNoAliasAA.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Transforms/IPO/FunctionAttrs.h"
+#include "llvm/Transforms/IPO/InferFunctionAttrs.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/LoopVersioning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
 
 
 using namespace llvm;
 
-static void LoopInvariantCodeMotion(Module *);
+struct P3Options;
+static void LoopInvariantCodeMotion(Module *, const P3Options &Opts);
 
 static void summarize(Module *M);
 static void print_csv_file(std::string outputfile);
+static bool print_json_file(const std::string &outputfile, StringRef ModuleName, raw_ostream &Log);
 
 static cl::opt<std::string>
-        InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::Required, cl::init("-"));
+        InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::Optional, cl::init("-"));
 
 static cl::opt<std::string>
-        OutputFilename(cl::Positional, cl::desc("<output bitcode>"), cl::Required, cl::init("out.bc"));
+        OutputFilename(cl::Positional, cl::desc("<output bitcode>"), cl::Optional, cl::init("out.bc"));
 
 static cl::opt<bool>
         Mem2Reg("mem2reg",
@@ -56,6 +125,69 @@ static cl::opt<bool>
               cl::desc("Do not perform LICM optimization."),
               cl::init(false));
 
+static cl::opt<bool>
+        LICMMemSSA("licm-memssa",
+              cl::desc("Use MemorySSA and alias analysis to find loads that can be hoisted."),
+              cl::init(false));
+
+static cl::opt<bool>
+        NoMathErrno("licm-no-math-errno",
+              cl::desc("Assume math library calls do not set errno, like -fno-math-errno."),
+              cl::init(false));
+
+static cl::opt<bool>
+        HoistOutermost("licm-hoist-outermost",
+              cl::desc("Hoist each invariant straight to the outermost loop it is invariant in."),
+              cl::init(false));
+
+static cl::opt<bool>
+        TypedAA("licm-typed-aa",
+              cl::desc("Assume C aliasing rules: loads and stores of different scalar types do not alias, unless one is a char, and an index into an inner array stays inside it."),
+              cl::init(false));
+
+static cl::opt<bool>
+        VersionLoops("licm-version",
+              cl::desc("Version innermost loops with runtime alias checks so that the checked copy can hoist more."),
+              cl::init(false));
+
+static cl::opt<unsigned>
+        VersionMaxSize("licm-version-max-size",
+              cl::desc("Largest loop, in instructions, that -licm-version duplicates."),
+              cl::init(100));
+
+static cl::opt<unsigned>
+        UnswitchMaxSize("licm-unswitch-max-size",
+              cl::desc("Largest loop, in instructions, duplicated to unswitch an invariant branch; 0 only moves branches to an exit."),
+              cl::init(50));
+
+static cl::opt<int>
+        RegBudget("licm-reg-budget",
+              cl::desc("Registers per register class that hoisting may keep live across a loop: 0 asks the target, -1 (the default) hoists regardless."),
+              cl::value_desc("N"),
+              cl::init(-1));
+
+static cl::opt<unsigned>
+        Jobs("j",
+              cl::desc("Run LICM on N function partitions in parallel."),
+              cl::value_desc("N"),
+              cl::init(1));
+
+enum EmitKind { EmitBitcode, EmitAssembly, EmitObject };
+
+static cl::opt<EmitKind>
+        Emit("emit",
+              cl::desc("Also generate code for the target after LICM."),
+              cl::values(clEnumValN(EmitBitcode, "bc", "Bitcode only"),
+                         clEnumValN(EmitAssembly, "asm", "Assembly next to the output, as <output>.s"),
+                         clEnumValN(EmitObject, "obj", "Object file next to the output, as <output>.o")),
+              cl::init(EmitBitcode));
+
+static cl::opt<unsigned>
+        CodegenJobs("codegen-j",
+              cl::desc("Split code generation into N modules, written as <output>.<i>.o for i > 0."),
+              cl::value_desc("N"),
+              cl::init(1));
+
 static cl::opt<bool>
         Verbose("verbose",
                     cl::desc("Verbose stats."),
@@ -66,357 +198,4043 @@ static cl::opt<bool>
                 cl::desc("Do not check for valid IR."),
                 cl::init(false));
 
-int main(int argc, char **argv) {
-    // Parse command line arguments
-    cl::ParseCommandLineOptions(argc, argv, "llvm system compiler\n");
+static cl::opt<bool>
+        StatsJSON("licm-stats-json",
+                cl::desc("Also write per-function and per-loop records to <output>.stats.json."),
+                cl::init(false));
 
-    // Handle creating output files and shutting down properly
-    llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
-    LLVMContext Context;
+static cl::opt<std::string>
+        RemarksFile("pass-remarks-output",
+                cl::desc("Write YAML optimization remarks for hoisted and rejected instructions; batch jobs use <output>.opt.yaml."),
+                cl::value_desc("file"),
+                cl::init(""));
 
-    // LLVM idiom for constructing output file.
-    std::unique_ptr<ToolOutputFile> Out;
-    std::string ErrorInfo;
-    std::error_code EC;
-    Out.reset(new ToolOutputFile(OutputFilename.c_str(), EC,
-                                 sys::fs::OF_None));
+static cl::opt<std::string>
+        TimeTrace("time-trace",
+                cl::desc("Write a Chrome trace of the compile phases, functions and loops, and add phase times to the .stats file."),
+                cl::value_desc("file"),
+                cl::init(""));
 
-    EnableStatistics();
+static cl::opt<unsigned>
+        TimeTraceGranularity("time-trace-granularity",
+                cl::desc("Minimum time in microseconds for a scope to be traced."),
+                cl::init(500));
 
-    // Read in module
-    SMDiagnostic Err;
-    std::unique_ptr<Module> M;
-    M = parseIRFile(InputFilename, Err, Context);
+static cl::opt<std::string>
+        Batch("batch",
+                cl::desc("Optimize every '<input> <output> [flags]' line of a list file; -j sets the number of workers."),
+                cl::value_desc("list.txt"),
+                cl::init(""));
 
-    // If errors, fail
-    if (M.get() == 0)
-    {
-        Err.print(argv[0], errs());
-        //FIXME: there is a segmentation fault
-        return 1;
-    }
+static cl::opt<std::string>
+        Serve("serve",
+                cl::desc("Run as a compile server listening on a Unix socket."),
+                cl::value_desc("socket"),
+                cl::init(""));
 
-    // If requested, do some early optimizations
-    if (Mem2Reg || CSE)
-    {
-        legacy::PassManager Passes;
-	if (Mem2Reg)
-	  Passes.add(createPromoteMemoryToRegisterPass());
-	if (CSE)
-	  Passes.add(createEarlyCSEPass());
-        Passes.run(*M.get());
-    }
+static cl::opt<unsigned>
+        ServeCacheSize("serve-cache",
+                cl::desc("Number of parsed modules the compile server keeps."),
+                cl::value_desc("N"),
+                cl::init(64));
 
-    if (!NoLICM) {
-        LoopInvariantCodeMotion(M.get());
-    }
+static cl::opt<std::string>
+        Connect("connect",
+                cl::desc("Send the job to the compile server listening on a Unix socket."),
+                cl::value_desc("socket"),
+                cl::init(""));
 
-    // Collect statistics on Module
-    summarize(M.get());
-    print_csv_file(OutputFilename);
+/* Options */
 
-    if (Verbose)
-        PrintStatistics(errs());
+// Everything that can differ between the jobs of a batch. A single run takes
+// them from the command line, a batch line starts from those and adds its own,
+// and a compile server request starts from the defaults and adds the client's.
+struct P3Options {
+    bool Mem2Reg = false;
+    bool CSE = false;
+    bool NoLICM = false;
+    bool LICMMemSSA = false;
+    bool NoMathErrno = false;
+    bool HoistOutermost = false;
+    bool TypedAA = false;
+    bool VersionLoops = false;
+    unsigned Jobs = 1;
+    bool Verbose = false;
+    bool NoCheck = false;
+    EmitKind Emit = EmitBitcode;
+    unsigned CodegenJobs = 1;
+    bool StatsJSON = false;
+    std::string RemarksFile;
+    int RegBudget = -1;
+    unsigned VersionMaxSize = 100;
+    unsigned UnswitchMaxSize = 50;
+    std::string TimeTrace;
+    unsigned TimeTraceGranularity = 500;
+};
 
-    // Verify integrity of Module, do this by default
-    if (!NoCheck)
-    {
-        legacy::PassManager Passes;
-        Passes.add(createVerifierPass());
-        Passes.run(*M.get());
-    }
+static P3Options OptionsFromCommandLine(){
+    return {Mem2Reg, CSE, NoLICM, LICMMemSSA, NoMathErrno, HoistOutermost, TypedAA, VersionLoops, Jobs, Verbose, NoCheck, Emit, CodegenJobs,
+            StatsJSON, RemarksFile, RegBudget, VersionMaxSize, UnswitchMaxSize, TimeTrace, TimeTraceGranularity};
+}
 
-    // Write final bitcode
-    WriteBitcodeToFile(*M.get(), Out->os());
-    Out->keep();
+// per-job flags accepted by batch lines and the compile server
+static const struct {
+    const char *Name;
+    bool P3Options::*Field;
+} JobFlags[] = {
+    {"mem2reg", &P3Options::Mem2Reg},
+    {"cse", &P3Options::CSE},
+    {"no-licm", &P3Options::NoLICM},
+    {"licm-memssa", &P3Options::LICMMemSSA},
+    {"licm-no-math-errno", &P3Options::NoMathErrno},
+    {"licm-hoist-outermost", &P3Options::HoistOutermost},
+    {"licm-typed-aa", &P3Options::TypedAA},
+    {"licm-version", &P3Options::VersionLoops},
+    {"verbose", &P3Options::Verbose},
+    {"no", &P3Options::NoCheck},
+    {"licm-stats-json", &P3Options::StatsJSON},
+};
 
-    return 0;
-}
+// per-job numeric options, given as -name=N
+static const struct {
+    const char *Name;
+    unsigned P3Options::*Field;
+} NumericJobFlags[] = {
+    {"licm-version-max-size", &P3Options::VersionMaxSize},
+    {"licm-unswitch-max-size", &P3Options::UnswitchMaxSize},
+    {"time-trace-granularity", &P3Options::TimeTraceGranularity},
+};
 
-static llvm::Statistic nFunctions = {"", "Functions", "number of functions"};
-static llvm::Statistic nInstructions = {"", "Instructions", "number of instructions"};
-static llvm::Statistic nLoads = {"", "Loads", "number of loads"};
-static llvm::Statistic nStores = {"", "Stores", "number of stores"};
+static bool ParseJobFlag(StringRef Flag, P3Options &Opts){
+    /* Applies one flag of a batch line, - and -- prefixes are both accepted */
+    if (!Flag.consume_front("--")){
+        Flag.consume_front("-");
+    }
 
-static void summarize(Module *M) {
-    for (auto i = M->begin(); i != M->end(); i++) {
-        if (i->begin() != i->end()) {
-            nFunctions++;
+    for (auto &JF: JobFlags){
+        if (Flag == JF.Name){
+            Opts.*JF.Field = true;
+            return true;
         }
+    }
 
-        for (auto j = i->begin(); j != i->end(); j++) {
-            for (auto k = j->begin(); k != j->end(); k++) {
-                Instruction &I = *k;
-                nInstructions++;
-                if (isa<LoadInst>(&I)) {
-                    nLoads++;
-                } else if (isa<StoreInst>(&I)) {
-                    nStores++;
-                }
-            }
+    StringRef Value;
+    std::tie(Flag, Value) = Flag.split('=');
+    for (auto &JF: NumericJobFlags){
+        if (Flag == JF.Name){
+            return !Value.getAsInteger(10, Opts.*JF.Field);
         }
     }
+    if (Flag == "licm-reg-budget"){
+        return !Value.getAsInteger(10, Opts.RegBudget);
+    }
+    return false;
 }
 
-static void print_csv_file(std::string outputfile)
-{
-    std::ofstream stats(outputfile + ".stats");
-    auto a = GetStatistics();
-    for (auto p : a) {
-        stats << p.first.str() << "," << p.second << std::endl;
+static std::vector<std::string> JobFlagsOf(const P3Options &Opts){
+    /* The flags that ParseJobFlag turns back into Opts, numeric ones always */
+    std::vector<std::string> Flags;
+    for (auto &JF: JobFlags){
+        if (Opts.*JF.Field){
+            Flags.push_back(std::string("-") + JF.Name);
+        }
     }
-    stats.close();
+    for (auto &JF: NumericJobFlags){
+        Flags.push_back(std::string("-") + JF.Name + "=" + utostr(Opts.*JF.Field));
+    }
+    Flags.push_back("-licm-reg-budget=" + itostr(Opts.RegBudget));
+    return Flags;
 }
 
-static llvm::Statistic NumLoops = {"", "NumLoops", "number of loops analyzed"};
-static llvm::Statistic LICMBasic = {"", "LICMBasic", "basic loop invariant instructions"};
-static llvm::Statistic LICMLoadHoist = {"", "LICMLoadHoist", "loop invariant load instructions"};
-static llvm::Statistic LICMNoPreheader = {"", "LICMNoPreheader", "absence of preheader prevents optimization"};
-static llvm::Statistic NumLoopsNoStore = {"", "NumLoopsNoStore", "subset of loops that has no Store instructions"};
-static llvm::Statistic NumLoopsNoLoad = {"", "NumLoopsNoLoad", "subset of loops that has no Load instructions"};
-static llvm::Statistic NumLoopsNoStoreWithLoad = {"", "NumLoopsNoStoreWithLoad", "subset of loops with no stores that also have at least one load."};
-static llvm::Statistic NumLoopsWithCall = {"", "NumLoopsWithCall", "subset of loops that has a call instructions"};
+/* Statistics */
 
-/* Functionality Implementation */
+// llvm::Statistic values are process wide, so the counters live in a JobStats
+// that belongs to one module. Whoever runs a job points CurrentStats at its
+// JobStats on every thread that works on the module.
+class JobStatistic {
+    const char *DebugType;
+    const char *Name;
+    const char *Desc;
+    unsigned Id;
 
-static void hoistInstructionToPreheader(Instruction* I, BasicBlock* PreHeader){
-    /* Move an instruction to the PreHeader*/
-    Instruction *dst = PreHeader->getTerminator();
-    I->moveBefore(dst);
-}
+public:
+    static std::vector<JobStatistic*> &registry(){
+        static std::vector<JobStatistic*> Registry;
+        return Registry;
+    }
 
-static bool AreAllOperandsLoopInvaraint(Loop* L, Instruction* I){
-    /* Alternative implementation of hasLoopInvariantOperands */
-    for (auto &op: I->operands()){
-        if (!L->isLoopInvariant(op)){
-             return false;
-        }
+    JobStatistic(const char *DebugType, const char *Name, const char *Desc)
+        : DebugType(DebugType), Name(Name), Desc(Desc), Id(registry().size()) {
+        registry().push_back(this);
     }
 
-    return true;
-}
+    const char *getDebugType() const { return DebugType; }
+    const char *getName() const { return Name; }
+    const char *getDesc() const { return Desc; }
+    unsigned getId() const { return Id; }
 
-static bool dominatesLoopExit(Function *F, Loop *L, Value* V){
-    /* Checks whether an instruction dominates all the loop exits */
-    SmallVector<BasicBlock *, 20> ExitBlocks;
-    L->getExitBlocks(ExitBlocks);
+    uint64_t getValue() const;
+    operator uint64_t() const { return getValue(); }
 
-    if (ExitBlocks.empty()){
-        return true;
+    JobStatistic &operator++();
+    uint64_t operator++(int);
+};
+
+// What kept an instruction in its loop, as reported by -licm-stats-json
+enum RejectReason {
+    RejectVolatile,
+    RejectStoreAlias,
+    RejectCall,
+    RejectNoPreheader,
+    RejectVariant,
+    RejectUnsafe,
+    RejectRegPressure,
+    NumRejectReasons
+};
+
+static const char *RejectReasonNames[NumRejectReasons] = {
+    "volatile", "store_alias", "call", "no_preheader", "variant", "unsafe", "register_pressure"
+};
+
+struct LoopRecord {
+    std::string Header;
+    unsigned Depth = 0;
+    const char *TripCount = "unknown";
+    bool Versioned = false;
+    unsigned Instructions = 0;
+    unsigned Hoisted = 0;
+    unsigned LoadsHoisted = 0;
+    unsigned CallsHoisted = 0;
+    unsigned Promoted = 0;
+    unsigned Sunk = 0;
+    unsigned UnswitchedTrivial = 0;
+    unsigned Unswitched = 0;
+    unsigned Rejected[NumRejectReasons] = {};
+};
+
+struct FunctionRecord {
+    std::string Name;
+    unsigned Instructions = 0;
+    std::vector<LoopRecord> Loops;
+    // only valid while the function is being optimized
+    DenseMap<const Loop*, unsigned> Index;
+
+    LoopRecord *get(const Loop *L){
+        auto It = Index.find(L);
+        return It == Index.end() ? nullptr : &Loops[It->second];
     }
+};
 
-    Instruction* i = dyn_cast<Instruction>(V);
-    DominatorTree *DT=nullptr;
-    DT = new DominatorTree();
+class JobStats {
+    std::unique_ptr<std::atomic<uint64_t>[]> Values;
 
-    DT->recalculate(*F);
-    for (auto *bb: ExitBlocks){
-        bool result = DT->dominates(i->getParent(), bb);
-        if (!result){
-            return false;
+    // per-function records, only kept with -licm-stats-json
+    std::mutex RecordsLock;
+    std::vector<FunctionRecord> Functions;
+
+    // phase times in microseconds, only kept with -time-trace
+    struct PhaseTime {
+        std::string Name;
+        uint64_t Wall;
+        uint64_t CPU;
+    };
+    std::vector<PhaseTime> Phases;
+
+public:
+    JobStats() : Values(new std::atomic<uint64_t>[JobStatistic::registry().size()]) {
+        for (unsigned i = 0; i < JobStatistic::registry().size(); i++){
+            Values[i] = 0;
         }
     }
 
-    return true;
-}
+    std::atomic<uint64_t> &operator[](const JobStatistic &S) { return Values[S.getId()]; }
 
+    std::vector<const JobStatistic*> collected(){
+        std::vector<const JobStatistic*> Stats;
+        for (JobStatistic *S: JobStatistic::registry()){
+            if (Values[S->getId()]){
+                Stats.push_back(S);
+            }
+        }
+        return Stats;
+    }
 
-static bool NoPossibleStoresToAnyAddressInLoop(Loop *L){
-    for (auto *bb: L->blocks()){
-        for (auto &i: *bb){
-            if (isa<StoreInst>(i) || isa<CallInst>(i)){
-                return false;
-           }
+    void printCSV(std::ostream &OS){
+        auto Stats = collected();
+        std::sort(Stats.begin(), Stats.end(), [](const JobStatistic *A, const JobStatistic *B){
+            return StringRef(A->getName()) < StringRef(B->getName());
+        });
+        for (auto *S: Stats){
+            OS << S->getName() << "," << Values[S->getId()] << std::endl;
+        }
+        for (auto &P: Phases){
+            OS << "Time" << P.Name << "WallUs," << P.Wall << std::endl;
+            OS << "Time" << P.Name << "CpuUs," << P.CPU << std::endl;
         }
     }
 
-    //after all of this - this is a safe load
-    return true;
-}
+    void addFunctionRecord(FunctionRecord &&FR){
+        FR.Index.clear();
+        std::lock_guard<std::mutex> Guard(RecordsLock);
+        Functions.push_back(std::move(FR));
+    }
 
-static bool NoPossibleStoresToAddressInLoop(Loop *L, Value* LoadAddress){
-    //no possible stores to addr in L
-    for (auto *bb: L->blocks()){
-        for (auto &i: *bb){
-            if (isa<StoreInst>(i)){
-                Value *addr_of_store = i.getOperand(1);
-                if (LoadAddress == addr_of_store){
-                    return false;
-                } 
-                // different address - if it's neither an alloca nor a global
-                // varible it could be loading to that address
-                else if (!isa<AllocaInst>(addr_of_store) && !isa<GlobalVariable>(addr_of_store)){
-                    return false;
+    void printJSON(raw_ostream &OS, StringRef ModuleName){
+        /* One object per function, sorted by name so that -j gives the same
+         * file, with its totals and one record per loop in preorder */
+        std::sort(Functions.begin(), Functions.end(), [](const FunctionRecord &A, const FunctionRecord &B){
+            return A.Name < B.Name;
+        });
+
+        auto Counters = [](json::OStream &J, const LoopRecord &R){
+            J.attribute("hoisted", R.Hoisted);
+            J.attribute("loads_hoisted", R.LoadsHoisted);
+            J.attribute("calls_hoisted", R.CallsHoisted);
+            J.attribute("promoted", R.Promoted);
+            J.attribute("sunk", R.Sunk);
+            J.attribute("unswitched_trivial", R.UnswitchedTrivial);
+            J.attribute("unswitched", R.Unswitched);
+            J.attributeObject("rejected", [&]{
+                for (unsigned r = 0; r < NumRejectReasons; r++){
+                    J.attribute(RejectReasonNames[r], R.Rejected[r]);
                 }
-           }
+            });
+        };
 
-           if (isa<CallInst>(i)){
-                return false;
-           } 
+        json::OStream J(OS, 2);
+        J.object([&]{
+            J.attribute("module", ModuleName);
+            J.attributeArray("functions", [&]{
+                for (auto &FR: Functions){
+                    LoopRecord Total;
+                    for (auto &R: FR.Loops){
+                        Total.Hoisted += R.Hoisted;
+                        Total.LoadsHoisted += R.LoadsHoisted;
+                        Total.CallsHoisted += R.CallsHoisted;
+                        Total.Promoted += R.Promoted;
+                        Total.Sunk += R.Sunk;
+                        Total.UnswitchedTrivial += R.UnswitchedTrivial;
+                        Total.Unswitched += R.Unswitched;
+                        for (unsigned r = 0; r < NumRejectReasons; r++){
+                            Total.Rejected[r] += R.Rejected[r];
+                        }
+                    }
+
+                    J.object([&]{
+                        J.attribute("name", FR.Name);
+                        J.attribute("instructions", FR.Instructions);
+                        J.attribute("loops", (uint64_t)FR.Loops.size());
+                        Counters(J, Total);
+                        J.attributeArray("loop_records", [&]{
+                            for (auto &R: FR.Loops){
+                                J.object([&]{
+                                    J.attribute("header", R.Header);
+                                    J.attribute("depth", R.Depth);
+                                    J.attribute("trip_count", R.TripCount);
+                                    J.attribute("versioned", R.Versioned);
+                                    J.attribute("instructions", R.Instructions);
+                                    Counters(J, R);
+                                });
+                            }
+                        });
+                    });
+                }
+            });
+        });
+        OS << "\n";
+    }
+
+    void addPhaseTime(StringRef Name, uint64_t Wall, uint64_t CPU){
+        for (auto &P: Phases){
+            if (P.Name == Name){
+                P.Wall += Wall;
+                P.CPU += CPU;
+                return;
+            }
         }
+        Phases.push_back({Name.str(), Wall, CPU});
     }
 
-    //after all of this - this is a safe load
-    return true;
-}
+    void print(raw_ostream &OS){
+        /* Same layout as llvm::PrintStatistics */
+        auto Stats = collected();
+        if (Stats.empty()){
+            return;
+        }
+        std::stable_sort(Stats.begin(), Stats.end(), [](const JobStatistic *A, const JobStatistic *B){
+            return std::make_tuple(StringRef(A->getDebugType()), StringRef(A->getName()), StringRef(A->getDesc()))
+                 < std::make_tuple(StringRef(B->getDebugType()), StringRef(B->getName()), StringRef(B->getDesc()));
+        });
 
-static bool AllocaNotInLoop(Loop *L, Value *Addr){
-    Instruction *x = dyn_cast<AllocaInst>(Addr);
-    BasicBlock *parent = x->getParent();
+        unsigned MaxDebugTypeLen = 0, MaxValLen = 0;
+        for (auto *S: Stats){
+            MaxValLen = std::max(MaxValLen, (unsigned)utostr(Values[S->getId()]).size());
+            MaxDebugTypeLen = std::max(MaxDebugTypeLen, (unsigned)std::strlen(S->getDebugType()));
+        }
 
-    if (L->contains(parent)){
-        return false;
+        OS << "===" << std::string(73, '-') << "===\n"
+           << "                          ... Statistics Collected ...\n"
+           << "===" << std::string(73, '-') << "===\n\n";
+        for (auto *S: Stats){
+            OS << format("%*" PRIu64 " %-*s - %s\n", MaxValLen, Values[S->getId()].load(),
+                         MaxDebugTypeLen, S->getDebugType(), S->getDesc());
+        }
+        OS << '\n';
+        OS.flush();
     }
+};
 
-    return true;
+static thread_local JobStats *CurrentStats = nullptr;
+
+uint64_t JobStatistic::getValue() const { return (*CurrentStats)[*this]; }
+
+JobStatistic &JobStatistic::operator++(){
+    ++(*CurrentStats)[*this];
+    return *this;
 }
 
-static bool CanMoveOutofLoop(Function *F, Loop *L, Instruction* I, Value* LoadAddress, bool loopHasStore){
-    /* Determines whether an instruction can be moved out of a loop
-     * */
+uint64_t JobStatistic::operator++(int){
+    return (*CurrentStats)[*this]++;
+}
 
-    // Case 1: instruction marked volatile - cannot be moved out of the loop 
-    if (I->isVolatile()){
-        return false;
-    }
+/* Time tracing */
+
+static uint64_t ThreadCPUMicros(){
+    timespec TS;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &TS);
+    return TS.tv_sec * 1000000ull + TS.tv_nsec / 1000;
+}
 
-    if (isa<GlobalVariable>(LoadAddress) && NoPossibleStoresToAddressInLoop(L, LoadAddress)){
+class PhaseScope {
+    /* One compile phase: a scope in the time trace and, with -time-trace,
+     * wall and CPU time of the running thread added to the job's .stats */
+    TimeTraceScope Trace;
+    const char *Name;
+    std::chrono::steady_clock::time_point WallStart;
+    uint64_t CPUStart;
 
-        return true;
-    }
+public:
+    PhaseScope(const char *Name)
+        : Trace(Name), Name(Name), WallStart(std::chrono::steady_clock::now()), CPUStart(ThreadCPUMicros()) {}
 
-    if (isa<AllocaInst>(LoadAddress)
-        && AllocaNotInLoop(L, LoadAddress)
-        && NoPossibleStoresToAddressInLoop(L, LoadAddress)){
-   
-        return true;
+    ~PhaseScope(){
+        if (!timeTraceProfilerEnabled() || !CurrentStats){
+            return;
+        }
+        auto Wall = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - WallStart);
+        CurrentStats->addPhaseTime(Name, Wall.count(), ThreadCPUMicros() - CPUStart);
     }
-   
-    /*
-    // Worked on this but did not have it fully functioning due to segfaults 
-    if (L->isLoopInvariant(LoadAddress)
-        && NoPossibleStoresToAnyAddressInLoop(L) 
-        && dominatesLoopExit(F, L, LoadAddress)
-        ){
+};
 
-        return true;
-    } 
-    */
+class TraceThread {
+    /* Worker threads need their own time trace profiler, which is merged into
+     * the one of the main thread when the work is done */
+public:
+    TraceThread(const P3Options &Opts){
+        if (!Opts.TimeTrace.empty()){
+            timeTraceProfilerInitialize(Opts.TimeTraceGranularity, "p3");
+        }
+    }
 
-    return false;
-}
+    ~TraceThread(){
+        if (timeTraceProfilerEnabled()){
+            timeTraceProfilerFinishThread();
+        }
+    }
+};
 
-static void updateStats(bool hasLoad, bool hasStore){
-    if (!hasStore && hasLoad){
-        NumLoopsNoStoreWithLoad++;
-    } else if (!hasLoad){
-        NumLoopsNoLoad++;
-    } else if (!hasStore){
-        NumLoopsNoStore++;
+static void StartTimeTrace(StringRef ProcName){
+    /* -time-trace of a run in this process, written by WriteTimeTrace */
+    if (!TimeTrace.empty()){
+        timeTraceProfilerInitialize(TimeTraceGranularity, ProcName);
     }
 }
 
-static bool NotALoadOrStore(Instruction* I){
-    if (isa<LoadInst>(I)){
-        return false;
+static int WriteTimeTrace(int Status){
+    /* Writes the -time-trace file once all jobs are done */
+    if (!timeTraceProfilerEnabled()){
+        return Status;
     }
-    if (isa<StoreInst>(I)){
-        return false;
+
+    if (Error E = timeTraceProfilerWrite(TimeTrace, OutputFilename)){
+        errs() << "p3: " << TimeTrace << ": " << toString(std::move(E)) << "\n";
+        Status = 1;
     }
-    return true;
+    timeTraceProfilerCleanup();
+    return Status;
 }
 
-static void OptimizeLoop(Function *f, LoopInfoBase<BasicBlock, Loop> *LIBase, Loop *L){
-    NumLoops++;
+static std::string LoopTraceDetail(Loop *L){
+    /* Header name and depth, the header may only have a slot number */
+    std::string Detail;
+    raw_string_ostream OS(Detail);
+    L->getHeader()->printAsOperand(OS, false);
+    OS << " depth " << L->getLoopDepth();
+    return OS.str();
+}
 
-    BasicBlock *PH = L->getLoopPreheader();
-    if (PH==NULL){
-        LICMNoPreheader++;
-        return;
+/* Driver */
+
+static std::string CodeFileName(const std::string &OutputFile, EmitKind Kind, unsigned Part){
+    /* out.bc becomes out.o, and out.1.o, out.2.o, ... for split code generation */
+    SmallString<128> Path(OutputFile);
+    std::string Ext = Kind == EmitAssembly ? "s" : "o";
+    sys::path::replace_extension(Path, Part ? utostr(Part) + "." + Ext : Ext);
+    return std::string(Path.str());
+}
+
+static bool EmitCode(Module &M, const std::string &OutputFile, const P3Options &Opts, raw_ostream &Log){
+    /* Generates code for the module triple (the host if it has none) with
+     * the same defaults as llc, so the result can go straight to gcc */
+    std::string TripleName = M.getTargetTriple();
+    if (TripleName.empty()){
+        TripleName = sys::getDefaultTargetTriple();
+        M.setTargetTriple(TripleName);
     }
 
-    //recursive call to optimize all the subloops
-    for (auto subloop: L->getSubLoops()){
-        OptimizeLoop(f, LIBase, subloop);
+    std::string Error;
+    const Target *T = TargetRegistry::lookupTarget(TripleName, Error);
+    if (!T){
+        Log << "p3: " << M.getModuleIdentifier() << ": " << Error << "\n";
+        return false;
     }
+    TargetOptions Options;
+    Options.MCOptions.AsmVerbose = true;
+    auto CreateTargetMachine = [&]{
+        return std::unique_ptr<TargetMachine>(T->createTargetMachine(TripleName, "", "", Options, None));
+    };
 
-    bool changed, hasLoad, hasStore, hasCall, loopContainsStore=false;
-    std::set<Instruction*> worklist;
+    CodeGenFileType FileType = Opts.Emit == EmitAssembly ? CGFT_AssemblyFile : CGFT_ObjectFile;
+    unsigned NumParts = std::max(1u, Opts.CodegenJobs);
 
-    hasCall  = false; 
-    for (BasicBlock *bb: L->blocks()){
-        changed  = hasLoad  = hasStore = false;
-        for (BasicBlock::iterator i = bb->begin(), e = bb->end(); i != e; ++i){
-            if (isa<LoadInst>(&*i)){
-                hasLoad = true;
-            }
-            if (isa<StoreInst>(&*i)){
-                hasStore = true;
-                loopContainsStore = true;
-            }
-            if (isa<CallInst>(&*i)){
-                hasCall = true;
-            }
-            worklist.insert(&*i);
+    std::vector<std::unique_ptr<ToolOutputFile>> Outs;
+    std::vector<raw_pwrite_stream*> OSs;
+    for (unsigned p = 0; p < NumParts; p++){
+        std::error_code EC;
+        std::string Name = CodeFileName(OutputFile, Opts.Emit, p);
+        Outs.emplace_back(new ToolOutputFile(Name, EC, FileType == CGFT_AssemblyFile ? sys::fs::OF_Text : sys::fs::OF_None));
+        if (EC){
+            Log << "p3: " << Name << ": " << EC.message() << "\n";
+            return false;
         }
+        OSs.push_back(&Outs.back()->os());
+    }
 
-        updateStats(hasLoad, hasStore);
-
-        //work with the worklist;
-        while (worklist.size() > 0){
-            changed = false;
-            Instruction* i = *worklist.begin();
-            worklist.erase(i);
-            
-            if (NotALoadOrStore(i)){
-                if (AreAllOperandsLoopInvaraint(L, i)){
-                    L->makeLoopInvariant(i, changed);
-                    if (changed) {
-                        LICMBasic++;
-                        continue;
-                    }
-                }
-            }
+    if (NumParts == 1){
+        std::unique_ptr<TargetMachine> TM = CreateTargetMachine();
+        if (M.getDataLayout().isDefault()){
+            M.setDataLayout(TM->createDataLayout());
+        }
 
-            else {
-                if (isa<LoadInst>(i)){
-                    Value* addr = i->getOperand(0); // address for Load instruction
-                    if (CanMoveOutofLoop(f, L, i, addr, loopContainsStore)){
-                        
-                        hoistInstructionToPreheader(i, PH);
-                        LICMLoadHoist++;
-                        //Move to PH
-                    } 
-                }
-            }
+        legacy::PassManager Passes;
+        Passes.add(new TargetLibraryInfoWrapperPass(TM->getTargetTriple()));
+        if (TM->addPassesToEmitFile(Passes, *OSs[0], nullptr, FileType)){
+            Log << "p3: " << TripleName << ": target cannot emit this file type\n";
+            return false;
         }
+        Passes.run(M);
+    } else {
+        splitCodeGen(M, OSs, {}, CreateTargetMachine, FileType);
+    }
+
+    // partitions left over from an earlier run with more of them
+    for (unsigned p = NumParts; sys::fs::exists(CodeFileName(OutputFile, Opts.Emit, p)); p++){
+        sys::fs::remove(CodeFileName(OutputFile, Opts.Emit, p));
     }
 
-    if (hasCall) {NumLoopsWithCall++;}
+    for (auto &Out: Outs){
+        Out->keep();
+    }
+    return true;
 }
 
-static void RunLICMBasic(Module *M){
+static bool OptimizeModule(Module *M, const P3Options &Opts, raw_ostream &Log){
+    /* Runs the requested passes and collects the statistics of M into
+     * CurrentStats. Returns false if the result is not valid IR. */
 
-    for (Module::iterator func = M->begin(); func != M->end(); ++func){
-        Function &F = *func;
-        // for empty function, stop considering
-        if (func->begin() == func->end()){
-            continue;
-        }
+    // If requested, do some early optimizations
+    if (Opts.Mem2Reg || Opts.CSE)
+    {
+        PhaseScope Phase("EarlyPasses");
+        legacy::PassManager Passes;
+	if (Opts.Mem2Reg)
+	  Passes.add(createPromoteMemoryToRegisterPass());
+	if (Opts.CSE)
+	  Passes.add(createEarlyCSEPass());
+        Passes.run(*M);
+    }
+
+    if (!Opts.NoLICM) {
+        PhaseScope Phase("LICM");
+        LoopInvariantCodeMotion(M, Opts);
+    }
 
-        DominatorTreeBase<BasicBlock,false> *DT=nullptr;
-        LoopInfoBase<BasicBlock,Loop> *LI = new LoopInfoBase<BasicBlock,Loop>();
-        DT = new DominatorTreeBase<BasicBlock,false>();
+    // Collect statistics on Module
+    {
+        PhaseScope Phase("Summarize");
+        summarize(M);
+    }
 
-        DT->recalculate(F); // dominance for Function, F
-        LI->analyze(*DT); // calculate loop info
+    if (Opts.Verbose)
+        CurrentStats->print(Log);
 
-        for(auto li: *LI) {
-            OptimizeLoop(&F, LI, li);
-        }
+    // Verify integrity of Module, do this by default
+    PhaseScope Phase("Verify");
+    if (!Opts.NoCheck && verifyModule(*M, &Log))
+    {
+        Log << "p3: " << M->getModuleIdentifier() << ": optimized module is broken\n";
+        return false;
     }
+
+    return true;
 }
 
-static void LoopInvariantCodeMotion(Module *M) {
-    RunLICMBasic(M);
+static int RunJob(const std::string &InputFile, const std::string &OutputFile, const P3Options &Opts, raw_ostream &Log){
+    /* Optimizes one module in its own LLVMContext and writes its bitcode and
+     * .stats file, counting into the caller's CurrentStats */
+    LLVMContext Context;
+
+    // LLVM idiom for constructing output file.
+    std::unique_ptr<ToolOutputFile> Out;
+    std::error_code EC;
+    Out.reset(new ToolOutputFile(OutputFile.c_str(), EC,
+                                 sys::fs::OF_None));
+    if (EC)
+    {
+        Log << "p3: " << OutputFile << ": " << EC.message() << "\n";
+        return 1;
+    }
+
+    // optimization remarks go straight from the context to the file
+    std::unique_ptr<ToolOutputFile> Remarks;
+    if (!Opts.RemarksFile.empty())
+    {
+        Expected<std::unique_ptr<ToolOutputFile>> RemarksOrErr =
+            setupLLVMOptimizationRemarks(Context, Opts.RemarksFile, "", "yaml", false);
+        if (!RemarksOrErr)
+        {
+            Log << "p3: " << Opts.RemarksFile << ": " << toString(RemarksOrErr.takeError()) << "\n";
+            return 1;
+        }
+        Remarks = std::move(*RemarksOrErr);
+    }
+
+    // Read in module
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M;
+    {
+        PhaseScope Phase("Parse");
+        M = parseIRFile(InputFile, Err, Context);
+    }
+
+    // If errors, fail
+    if (M.get() == 0)
+    {
+        Err.print("p3", Log);
+        return 1;
+    }
+
+    if (!OptimizeModule(M.get(), Opts, Log)){
+        return 1;
+    }
+
+    // Write final bitcode
+    {
+        PhaseScope Phase("WriteBitcode");
+        WriteBitcodeToFile(*M.get(), Out->os());
+        Out->os().flush();
+    }
+
+    if (Opts.Emit != EmitBitcode){
+        PhaseScope Phase("Codegen");
+        if (!EmitCode(*M, OutputFile, Opts, Log)){
+            return 1;
+        }
+    }
+
+    // last, so that it has the times of all phases
+    print_csv_file(OutputFile);
+    if (Opts.StatsJSON && !print_json_file(OutputFile, M->getModuleIdentifier(), Log)){
+        return 1;
+    }
+    if (Remarks){
+        Remarks->keep();
+    }
+    Out->keep();
+
+    return 0;
+}
+
+static int RunBatch(StringRef ListFile){
+    /* Runs every job of the list on a thread pool. Each job has its own
+     * LLVMContext and JobStats; its diagnostics are printed in one piece
+     * once it is done so output of different jobs does not interleave. */
+    ErrorOr<std::unique_ptr<MemoryBuffer>> List = MemoryBuffer::getFileOrSTDIN(ListFile);
+    if (!List){
+        errs() << "p3: " << ListFile << ": " << List.getError().message() << "\n";
+        return 1;
+    }
+
+    struct BatchJob {
+        std::string Input;
+        std::string Output;
+        P3Options Opts;
+    };
+    std::vector<BatchJob> BatchJobs;
+
+    SmallVector<StringRef, 16> Lines;
+    (*List)->getBuffer().split(Lines, '\n');
+    for (unsigned n = 0; n < Lines.size(); n++){
+        StringRef Line = Lines[n].split('#').first.trim();
+        if (Line.empty()){
+            continue;
+        }
+
+        SmallVector<StringRef, 8> Fields;
+        SplitString(Line, Fields, " \t");
+        if (Fields.size() < 2){
+            errs() << "p3: " << ListFile << ":" << n + 1 << ": expected '<input> <output> [flags]'\n";
+            return 1;
+        }
+
+        // partitions of one module would compete with the other jobs
+        P3Options Opts = OptionsFromCommandLine();
+        Opts.Jobs = 1;
+        if (!Opts.RemarksFile.empty()){
+            Opts.RemarksFile = Fields[1].str() + ".opt.yaml";
+        }
+        for (StringRef Flag: drop_begin(Fields, 2)){
+            if (!ParseJobFlag(Flag.trim(), Opts)){
+                errs() << "p3: " << ListFile << ":" << n + 1 << ": unknown flag '" << Flag << "'\n";
+                return 1;
+            }
+        }
+        BatchJobs.push_back({Fields[0].str(), Fields[1].str(), Opts});
+    }
+
+    std::mutex LogLock;
+    std::atomic<bool> Failed(false);
+    // one worker per core unless -j says otherwise
+    ThreadPool Pool(Jobs.getNumOccurrences() ? hardware_concurrency(Jobs) : heavyweight_hardware_concurrency());
+    for (auto &Job: BatchJobs){
+        Pool.async([&Job, &LogLock, &Failed]{
+            TraceThread Trace(Job.Opts);
+            TimeTraceScope JobScope("Job", Job.Input);
+            JobStats Stats;
+            CurrentStats = &Stats;
+
+            std::string Buffer;
+            raw_string_ostream Log(Buffer);
+            if (RunJob(Job.Input, Job.Output, Job.Opts, Log)){
+                Failed = true;
+            }
+            CurrentStats = nullptr;
+
+            std::lock_guard<std::mutex> Guard(LogLock);
+            errs() << Log.str();
+        });
+    }
+    Pool.wait();
+
+    return Failed ? 1 : 0;
+}
+
+/* Compile server */
+
+// Requests and replies are sequences of fields, each a 32-bit little endian
+// length followed by that many bytes. A request is the absolute input path
+// followed by a field with the client's flags, one per line; the reply is the
+// exit status, the log, the bitcode, the .stats contents, the -licm-stats-json
+// contents, the -time-trace contents and the remarks.
+static bool WriteAll(int FD, const char *Data, size_t Size){
+    while (Size){
+        ssize_t n = ::write(FD, Data, Size);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return false;
+        }
+        Data += n;
+        Size -= n;
+    }
+    return true;
+}
+
+static bool ReadAll(int FD, char *Data, size_t Size){
+    while (Size){
+        ssize_t n = ::read(FD, Data, Size);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return false;
+        }
+        Data += n;
+        Size -= n;
+    }
+    return true;
+}
+
+static bool WriteField(int FD, StringRef Field){
+    char Len[4];
+    support::endian::write32le(Len, Field.size());
+    return WriteAll(FD, Len, 4) && WriteAll(FD, Field.data(), Field.size());
+}
+
+// Largest field either side accepts. Paths and flags are short; bitcode,
+// logs and statistics come back from the server.
+static const uint32_t MaxShortField = 64 << 10;
+static const uint32_t MaxLongField = 1u << 30;
+
+static bool ReadField(int FD, std::string &Field, uint32_t MaxSize){
+    /* Fails on a length over MaxSize, so a peer cannot make us allocate
+     * whatever it claims */
+    char Len[4];
+    if (!ReadAll(FD, Len, 4)){
+        return false;
+    }
+    uint32_t Size = support::endian::read32le(Len);
+    if (Size > MaxSize){
+        return false;
+    }
+    Field.resize(Size);
+    return ReadAll(FD, &Field[0], Field.size());
+}
+
+static bool SocketAddress(StringRef Path, sockaddr_un &Addr, raw_ostream &Log){
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Addr.sun_path)){
+        Log << "p3: " << Path << ": socket path is too long\n";
+        return false;
+    }
+    memcpy(Addr.sun_path, Path.data(), Path.size());
+    return true;
+}
+
+class ModuleCache {
+    /* Parsed input modules keyed by the SHA1 of the file contents. Each entry
+     * owns its LLVMContext; jobs clone the pristine module and hold the entry
+     * lock while they work on it, so jobs on different inputs run in
+     * parallel. */
+public:
+    struct Entry {
+        std::mutex Lock;
+        LLVMContext Context;
+        std::unique_ptr<Module> M;
+        uint64_t LastUse = 0;
+    };
+
+private:
+    std::mutex Lock;
+    std::map<std::string, std::shared_ptr<Entry>> Entries;
+    uint64_t Clock = 0;
+
+public:
+    // returns the entry for the contents, locked, with M set on success
+    std::shared_ptr<Entry> lookup(MemoryBufferRef Contents, std::unique_lock<std::mutex> &EntryLock, raw_ostream &Log){
+        std::string Key = toHex(SHA1::hash(arrayRefFromStringRef(Contents.getBuffer())));
+
+        std::shared_ptr<Entry> E;
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            auto It = Entries.find(Key);
+            if (It == Entries.end()){
+                It = Entries.insert({Key, std::make_shared<Entry>()}).first;
+            }
+            E = It->second;
+            E->LastUse = ++Clock;
+
+            // entries still in use stay alive through their shared_ptr
+            while (Entries.size() > std::max(1u, (unsigned)ServeCacheSize)){
+                auto Oldest = std::min_element(Entries.begin(), Entries.end(), [](const decltype(Entries)::value_type &A,
+                                                                                  const decltype(Entries)::value_type &B){
+                    return A.second->LastUse < B.second->LastUse;
+                });
+                Entries.erase(Oldest);
+            }
+        }
+
+        EntryLock = std::unique_lock<std::mutex>(E->Lock);
+        if (!E->M){
+            SMDiagnostic Err;
+            E->M = parseIR(Contents, Err, E->Context);
+            if (!E->M){
+                Err.print("p3", Log);
+                std::lock_guard<std::mutex> Guard(Lock);
+                auto It = Entries.find(Key);
+                if (It != Entries.end() && It->second == E){
+                    Entries.erase(It);
+                }
+                return nullptr;
+            }
+        }
+        return E;
+    }
+};
+
+static void ServeRequest(int FD, ModuleCache &Cache){
+    /* Reads one request from FD, optimizes the module and sends the reply.
+     * The job only gets the client's flags, none of the server's own. */
+    std::string Input, Flag;
+    if (!ReadField(FD, Input, MaxShortField)){
+        return;
+    }
+
+    std::string Buffer;
+    raw_string_ostream Log(Buffer);
+    std::string Bitcode, Stats, JSON, Remarks;
+    SmallString<0> Trace;
+    int Status = 1;
+
+    std::string Flags;
+    if (!ReadField(FD, Flags, MaxShortField)){
+        return;
+    }
+
+    // partitions would compete with the other requests; the trace and the
+    // remarks go back to the client, which writes them to the files it names
+    P3Options Opts;
+    SmallVector<StringRef, 8> FlagList;
+    StringRef(Flags).split(FlagList, '\n', -1, false);
+    bool FlagsOK = true;
+    for (StringRef F: FlagList){
+        if (F.startswith("-time-trace=")){
+            Opts.TimeTrace = F.split('=').second.str();
+        }
+        else if (F.startswith("-pass-remarks-output=")){
+            Opts.RemarksFile = F.split('=').second.str();
+        }
+        else if (!ParseJobFlag(F, Opts)){
+            Log << "p3: unknown flag '" << F << "'\n";
+            FlagsOK = false;
+        }
+    }
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Contents = MemoryBuffer::getFile(Input);
+    if (!Contents){
+        Log << "p3: " << Input << ": " << Contents.getError().message() << "\n";
+    }
+    else if (FlagsOK){
+        JobStats JS;
+        CurrentStats = &JS;
+        TraceThread TraceJob(Opts);
+
+        std::unique_lock<std::mutex> EntryLock;
+        std::shared_ptr<ModuleCache::Entry> E;
+        std::unique_ptr<Module> M;
+        {
+            PhaseScope Phase("Parse");
+            E = Cache.lookup((*Contents)->getMemBufferRef(), EntryLock, Log);
+            if (E){
+                M = CloneModule(*E->M);
+                M->setModuleIdentifier(Input);
+            }
+        }
+
+        // the context belongs to the cache entry, so the remark streamer
+        // only stays on it while this request holds the entry
+        raw_string_ostream RemarksOS(Remarks);
+        if (M && !Opts.RemarksFile.empty()){
+            if (Error Err = setupLLVMOptimizationRemarks(E->Context, RemarksOS, "", "yaml", false)){
+                Log << "p3: " << Opts.RemarksFile << ": " << toString(std::move(Err)) << "\n";
+                M.reset();
+            }
+        }
+
+        if (M && OptimizeModule(M.get(), Opts, Log)){
+            {
+                PhaseScope Phase("WriteBitcode");
+                raw_string_ostream BC(Bitcode);
+                WriteBitcodeToFile(*M, BC);
+                BC.flush();
+            }
+
+            std::ostringstream CSV;
+            JS.printCSV(CSV);
+            Stats = CSV.str();
+
+            if (Opts.StatsJSON){
+                raw_string_ostream JS_OS(JSON);
+                JS.printJSON(JS_OS, Input);
+                JS_OS.flush();
+            }
+            Status = 0;
+        }
+
+        if (E){
+            E->Context.setLLVMRemarkStreamer(nullptr);
+            E->Context.setMainRemarkStreamer(nullptr);
+            RemarksOS.flush();
+        }
+        if (timeTraceProfilerEnabled()){
+            raw_svector_ostream TraceOS(Trace);
+            timeTraceProfilerWrite(TraceOS);
+            timeTraceProfilerCleanup();
+        }
+        CurrentStats = nullptr;
+    }
+
+    WriteField(FD, utostr(Status)) && WriteField(FD, Log.str())
+        && WriteField(FD, Bitcode) && WriteField(FD, Stats) && WriteField(FD, JSON)
+        && WriteField(FD, Trace) && WriteField(FD, Remarks);
+}
+
+static int RunServer(StringRef Path){
+    /* Serves optimization requests on a Unix socket until killed. Modules
+     * stay parsed between requests and requests run on a thread pool. */
+    sockaddr_un Addr;
+    if (!SocketAddress(Path, Addr, errs())){
+        return 1;
+    }
+
+    int FD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD < 0){
+        errs() << "p3: socket: " << strerror(errno) << "\n";
+        return 1;
+    }
+    // a socket left behind by an earlier server
+    ::unlink(Addr.sun_path);
+    if (::bind(FD, (sockaddr*)&Addr, sizeof(Addr)) < 0 || ::listen(FD, 64) < 0){
+        errs() << "p3: " << Path << ": " << strerror(errno) << "\n";
+        ::close(FD);
+        return 1;
+    }
+
+    // a client that goes away must not take the server with it
+    ::signal(SIGPIPE, SIG_IGN);
+
+    ModuleCache Cache;
+    ThreadPool Pool(Jobs.getNumOccurrences() ? hardware_concurrency(Jobs) : heavyweight_hardware_concurrency());
+    while (true){
+        int Conn = ::accept(FD, nullptr, nullptr);
+        if (Conn < 0){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            errs() << "p3: accept: " << strerror(errno) << "\n";
+            break;
+        }
+        Pool.async([Conn, &Cache]{
+            ServeRequest(Conn, Cache);
+            ::close(Conn);
+        });
+    }
+    Pool.wait();
+    ::close(FD);
+    return 1;
+}
+
+static bool WriteFileContents(const std::string &File, StringRef Contents){
+    std::error_code EC;
+    raw_fd_ostream OS(File, EC, sys::fs::OF_None);
+    if (EC){
+        errs() << "p3: " << File << ": " << EC.message() << "\n";
+        return false;
+    }
+    OS << Contents;
+    return true;
+}
+
+static int RunClient(StringRef Path, const std::string &InputFile, const std::string &OutputFile){
+    /* Sends the job to a compile server and writes what comes back. Falls
+     * back to running in process when no server is listening. */
+    P3Options Opts = OptionsFromCommandLine();
+    sockaddr_un Addr;
+    int FD = -1;
+    if (SocketAddress(Path, Addr, errs())){
+        FD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (FD >= 0 && ::connect(FD, (sockaddr*)&Addr, sizeof(Addr)) < 0){
+            ::close(FD);
+            FD = -1;
+        }
+    }
+    if (FD < 0){
+        JobStats Stats;
+        CurrentStats = &Stats;
+        StartTimeTrace("p3");
+        return WriteTimeTrace(RunJob(InputFile, OutputFile, Opts, errs()));
+    }
+
+    SmallString<256> Input(InputFile);
+    sys::fs::make_absolute(Input);
+
+    // the server only tells whether to trace and record remarks, the
+    // files are written here
+    std::vector<std::string> Flags = JobFlagsOf(Opts);
+    if (!Opts.TimeTrace.empty()){
+        Flags.push_back("-time-trace=" + Opts.TimeTrace);
+    }
+    if (!Opts.RemarksFile.empty()){
+        Flags.push_back("-pass-remarks-output=" + Opts.RemarksFile);
+    }
+
+    std::string Status, Log, Bitcode, Stats, JSON, Trace, Remarks;
+    bool OK = WriteField(FD, Input) && WriteField(FD, join(Flags, "\n"))
+        && ReadField(FD, Status, MaxShortField) && ReadField(FD, Log, MaxLongField)
+        && ReadField(FD, Bitcode, MaxLongField) && ReadField(FD, Stats, MaxLongField)
+        && ReadField(FD, JSON, MaxLongField) && ReadField(FD, Trace, MaxLongField)
+        && ReadField(FD, Remarks, MaxLongField);
+    ::close(FD);
+    if (!OK){
+        errs() << "p3: " << Path << ": connection to the server was lost\n";
+        return 1;
+    }
+
+    errs() << Log;
+    if (Status != "0"){
+        return 1;
+    }
+
+    std::error_code EC;
+    ToolOutputFile Out(OutputFile, EC, sys::fs::OF_None);
+    if (EC){
+        errs() << "p3: " << OutputFile << ": " << EC.message() << "\n";
+        return 1;
+    }
+    Out.os() << Bitcode;
+
+    std::ofstream StatsFile(OutputFile + ".stats");
+    StatsFile << Stats;
+    StatsFile.close();
+
+    if (!JSON.empty()){
+        std::ofstream JSONFile(OutputFile + ".stats.json");
+        JSONFile << JSON;
+        JSONFile.close();
+    }
+
+    if (!Opts.TimeTrace.empty() && !WriteFileContents(Opts.TimeTrace, Trace)){
+        return 1;
+    }
+    if (!Opts.RemarksFile.empty() && !WriteFileContents(Opts.RemarksFile, Remarks)){
+        return 1;
+    }
+
+    // the server only optimizes, code is generated here
+    if (Opts.Emit != EmitBitcode){
+        LLVMContext Context;
+        Expected<std::unique_ptr<Module>> M = parseBitcodeFile(MemoryBufferRef(Bitcode, OutputFile), Context);
+        if (!M){
+            errs() << "p3: " << OutputFile << ": " << toString(M.takeError()) << "\n";
+            return 1;
+        }
+        if (!EmitCode(**M, OutputFile, Opts, errs())){
+            return 1;
+        }
+    }
+
+    Out.keep();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    cl::ParseCommandLineOptions(argc, argv, "llvm system compiler\n");
+
+    // Handle creating output files and shutting down properly
+    llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
+
+    // the hoisting cost model asks the target for its registers
+    InitializeNativeTarget();
+    if (Emit != EmitBitcode){
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    }
+
+    // requests bring their own options, including -time-trace
+    if (!Serve.empty()){
+        return RunServer(Serve);
+    }
+
+    if (!Batch.empty()){
+        StartTimeTrace(argv[0]);
+        return WriteTimeTrace(RunBatch(Batch));
+    }
+
+    if (InputFilename.getNumOccurrences() == 0 || OutputFilename.getNumOccurrences() == 0){
+        errs() << argv[0] << ": expected <input bitcode> <output bitcode>, --batch or --serve\n";
+        return 1;
+    }
+
+    if (!Connect.empty()){
+        return RunClient(Connect, InputFilename, OutputFilename);
+    }
+
+    JobStats Stats;
+    CurrentStats = &Stats;
+    StartTimeTrace(argv[0]);
+
+    return WriteTimeTrace(RunJob(InputFilename, OutputFilename, OptionsFromCommandLine(), errs()));
+}
+
+static JobStatistic nFunctions = {"", "Functions", "number of functions"};
+static JobStatistic nInstructions = {"", "Instructions", "number of instructions"};
+static JobStatistic nLoads = {"", "Loads", "number of loads"};
+static JobStatistic nStores = {"", "Stores", "number of stores"};
+
+static void summarize(Module *M) {
+    for (auto i = M->begin(); i != M->end(); i++) {
+        if (i->begin() != i->end()) {
+            nFunctions++;
+        }
+
+        for (auto j = i->begin(); j != i->end(); j++) {
+            for (auto k = j->begin(); k != j->end(); k++) {
+                Instruction &I = *k;
+                nInstructions++;
+                if (isa<LoadInst>(&I)) {
+                    nLoads++;
+                } else if (isa<StoreInst>(&I)) {
+                    nStores++;
+                }
+            }
+        }
+    }
+}
+
+static bool print_json_file(const std::string &outputfile, StringRef ModuleName, raw_ostream &Log)
+{
+    std::error_code EC;
+    raw_fd_ostream stats(outputfile + ".stats.json", EC, sys::fs::OF_Text);
+    if (EC) {
+        Log << "p3: " << outputfile << ".stats.json: " << EC.message() << "\n";
+        return false;
+    }
+    CurrentStats->printJSON(stats, ModuleName);
+    return true;
+}
+
+static void print_csv_file(std::string outputfile)
+{
+    std::ofstream stats(outputfile + ".stats");
+    CurrentStats->printCSV(stats);
+    stats.close();
+}
+
+static JobStatistic NumLoops = {"", "NumLoops", "number of loops analyzed"};
+static JobStatistic LICMBasic = {"", "LICMBasic", "basic loop invariant instructions"};
+static JobStatistic LICMLoadHoist = {"", "LICMLoadHoist", "loop invariant load instructions"};
+static JobStatistic LICMLoadHoistAcrossCall = {"", "LICMLoadHoistAcrossCall", "subset of hoisted loads from loops that contain calls"};
+static JobStatistic LICMCallHoist = {"", "LICMCallHoist", "loop invariant calls to readnone/readonly functions"};
+static JobStatistic LICMPromoted = {"", "LICMPromoted", "loop carried memory locations promoted to registers"};
+static JobStatistic LICMNoPreheader = {"", "LICMNoPreheader", "absence of preheader prevents optimization"};
+static JobStatistic LICMPreheaderCreated = {"", "LICMPreheaderCreated", "preheaders inserted to put loops in simplified form"};
+static JobStatistic LICMVersionedLoops = {"", "LICMVersionedLoops", "loops duplicated behind runtime alias checks"};
+static JobStatistic LICMHoistDeferred = {"", "LICMHoistDeferred", "cheap invariants left in loops that are short of registers"};
+static JobStatistic LICMSunk = {"", "LICMSunk", "instructions only used after the loop moved into its exits"};
+static JobStatistic LICMUnswitchedTrivial = {"", "LICMUnswitchedTrivial", "invariant branches to a loop exit moved to the preheader"};
+static JobStatistic LICMUnswitched = {"", "LICMUnswitched", "loops duplicated for the two values of an invariant branch"};
+static JobStatistic NumLoopsNoStore = {"", "NumLoopsNoStore", "subset of loops that has no Store instructions"};
+static JobStatistic NumLoopsNoLoad = {"", "NumLoopsNoLoad", "subset of loops that has no Load instructions"};
+static JobStatistic NumLoopsNoStoreWithLoad = {"", "NumLoopsNoStoreWithLoad", "subset of loops with no stores that also have at least one load."};
+static JobStatistic NumLoopsWithCall = {"", "NumLoopsWithCall", "subset of loops that has a call instructions"};
+
+/* Register pressure */
+
+class RegPressure {
+    /* Estimate of the registers a loop needs for values that are live through
+     * all of it: the PHIs of its header and the values it uses from before
+     * the loop, per register class of the target. Hoisting an instruction
+     * adds it to the values from before the loop and may take operands out
+     * that nothing else in the loop uses. */
+    const TargetTransformInfo &TTI;
+    const Loop *L;
+    // -licm-reg-budget, the target's counts unless positive
+    int Budget;
+    SmallPtrSet<const Value*, 32> LiveIn;
+    SmallDenseMap<unsigned, int, 4> Live;
+
+    unsigned classOf(const Value *V) const {
+        Type *Ty = V->getType();
+        return TTI.getRegisterClassForType(Ty->isVectorTy(), Ty);
+    }
+
+    int budget(unsigned Class) const {
+        return Budget > 0 ? Budget : (int)TTI.getNumberOfRegisters(Class);
+    }
+
+    bool usedInLoop(const Value *V, const Instruction *Except) const {
+        for (const Use &U: V->uses()){
+            auto *UI = dyn_cast<Instruction>(U.getUser());
+            if (!UI || UI == Except){
+                continue;
+            }
+            // a PHI reads its value at the end of the incoming block
+            PHINode *PN = dyn_cast<PHINode>(UI);
+            if (L->contains(PN ? PN->getIncomingBlock(U) : UI->getParent())){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void delta(const Instruction *I, SmallDenseMap<unsigned, int, 4> &D) const {
+        /* What hoisting I changes in each class */
+        if (usedInLoop(I, nullptr)){
+            D[classOf(I)]++;
+        }
+        SmallPtrSet<const Value*, 4> Seen;
+        for (const Value *Op: I->operands()){
+            if (LiveIn.count(Op) && Seen.insert(Op).second && !usedInLoop(Op, I)){
+                D[classOf(Op)]--;
+            }
+        }
+    }
+
+public:
+    RegPressure(const TargetTransformInfo &TTI, const Loop *L, int Budget): TTI(TTI), L(L), Budget(Budget) {
+        for (const PHINode &PN: L->getHeader()->phis()){
+            Live[classOf(&PN)]++;
+        }
+        for (BasicBlock *bb: L->blocks()){
+            for (auto &i: *bb){
+                for (const Value *Op: i.operands()){
+                    // like globals and constants, allocas are addresses
+                    // the code forms again (frame offsets), not registers
+                    auto *OpI = dyn_cast<Instruction>(Op);
+                    if (!(isa<Argument>(Op) || (OpI && !L->contains(OpI))) || isa<AllocaInst>(Op)
+                        || LiveIn.count(Op)){
+                        continue;
+                    }
+                    if (usedInLoop(Op, nullptr)){
+                        LiveIn.insert(Op);
+                        Live[classOf(Op)]++;
+                    }
+                }
+            }
+        }
+    }
+
+    bool fits(const Instruction *I) const {
+        /* Whether the loop has the registers to keep I live through it */
+        SmallDenseMap<unsigned, int, 4> D;
+        delta(I, D);
+        for (auto &C: D){
+            if (C.second > 0 && Live.lookup(C.first) + C.second > budget(C.first)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void hoisted(const Instruction *I){
+        /* Accounts for I, which now lives before the loop */
+        SmallDenseMap<unsigned, int, 4> D;
+        delta(I, D);
+        for (auto &C: D){
+            Live[C.first] += C.second;
+        }
+        if (usedInLoop(I, nullptr)){
+            LiveIn.insert(I);
+        }
+        for (const Value *Op: I->operands()){
+            if (LiveIn.count(Op) && !usedInLoop(Op, I)){
+                LiveIn.erase(Op);
+            }
+        }
+    }
+};
+
+/* Analyses shared by everything that optimizes one function */
+
+/* Memory read or written by a set of instructions, in terms of the
+ * identified objects of the function that contains them: globals, allocas
+ * and arguments. Anything reached through another pointer sets the Any
+ * flag instead. */
+struct MemEffects {
+    SmallPtrSet<const Value*, 8> Reads, Writes;
+    bool ReadsAny = false;
+    bool WritesAny = false;
+
+    void merge(const MemEffects &Other){
+        Reads.insert(Other.Reads.begin(), Other.Reads.end());
+        Writes.insert(Other.Writes.begin(), Other.Writes.end());
+        ReadsAny |= Other.ReadsAny;
+        WritesAny |= Other.WritesAny;
+    }
+};
+
+static bool IsIdentifiedObject(const Value *Obj){
+    return isa<GlobalVariable>(Obj) || isa<AllocaInst>(Obj) || isa<Argument>(Obj);
+}
+
+static bool ObjectsMayInclude(const SmallPtrSetImpl<const Value*> &Objects, bool Any, const Value *Ptr){
+    /* Checks whether Ptr may point into one of Objects. An alloca is only
+     * reached through itself; a global may also be reached through an
+     * argument, and an argument through any global or other argument.
+     * Anything else may point anywhere. */
+    if (Any){
+        return true;
+    }
+
+    const Value *Obj = getUnderlyingObject(Ptr);
+    if (Objects.count(Obj)){
+        return true;
+    }
+    if (isa<AllocaInst>(Obj)){
+        return false;
+    }
+    if (!isa<GlobalVariable>(Obj) && !isa<Argument>(Obj)){
+        return !Objects.empty();
+    }
+    for (const Value *O: Objects){
+        if (isa<Argument>(O) || (isa<Argument>(Obj) && isa<GlobalVariable>(O))){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool MayRead(const MemEffects &E, const Value *Ptr){
+    return ObjectsMayInclude(E.Reads, E.ReadsAny, Ptr);
+}
+
+static bool MayWrite(const MemEffects &E, const Value *Ptr){
+    return ObjectsMayInclude(E.Writes, E.WritesAny, Ptr);
+}
+
+static void AddPointerEffect(const Value *Ptr, bool Read, bool Write, MemEffects &E){
+    SmallVector<const Value*, 4> Objects;
+    getUnderlyingObjects(Ptr, Objects);
+    for (const Value *Obj: Objects){
+        // accessing null is undefined
+        if (isa<ConstantPointerNull>(Obj)){
+            continue;
+        }
+        bool Identified = IsIdentifiedObject(Obj);
+        if (Read){
+            if (Identified){
+                E.Reads.insert(Obj);
+            } else {
+                E.ReadsAny = true;
+            }
+        }
+        if (Write){
+            if (Identified){
+                E.Writes.insert(Obj);
+            } else {
+                E.WritesAny = true;
+            }
+        }
+    }
+}
+
+static void AddCallEffectsFromAttributes(const CallBase &CB, MemEffects &E){
+    /* What the attributes of a call promise when the callee has no summary */
+    if (CB.doesNotAccessMemory() || CB.onlyAccessesInaccessibleMemory()){
+        return;
+    }
+
+    bool ReadOnly = CB.onlyReadsMemory();
+    if (CB.onlyAccessesArgMemory() || CB.onlyAccessesInaccessibleMemOrArgMem()){
+        for (unsigned a = 0; a < CB.arg_size(); a++){
+            const Value *Arg = CB.getArgOperand(a);
+            if (Arg->getType()->isPointerTy()){
+                AddPointerEffect(Arg, true, !ReadOnly && !CB.onlyReadsMemory(a), E);
+            }
+        }
+        return;
+    }
+
+    E.ReadsAny = true;
+    E.WritesAny |= !ReadOnly;
+}
+
+class ModRefSummaries {
+    /* Bottom-up mod/ref summaries of the defined functions of a module: the
+     * globals each function may read or write, itself or through its
+     * callees, and the pointer arguments it reads or writes through.
+     * Allocas of the function are dead once it returns and are left out.
+     * Only exact definitions are summarized; a call to a body the linker
+     * may replace reads and writes anything its attributes allow.
+     * Functions and globals are recorded by name, so that partitions in
+     * their own contexts can share the summaries of the whole module. */
+    struct FunctionModRef {
+        StringSet<> ReadGlobals, WrittenGlobals;
+        SmallBitVector ReadArgs, WrittenArgs;
+        bool ReadsAny = false;
+        bool WritesAny = false;
+
+        unsigned size() const {
+            // summaries only grow while an SCC is iterated
+            return ReadGlobals.size() + WrittenGlobals.size() + ReadArgs.count() + WrittenArgs.count()
+                + ReadsAny + WritesAny;
+        }
+    };
+    StringMap<FunctionModRef> Functions;
+
+    static void AddGlobals(const Module *M, const StringSet<> &Names, SmallPtrSetImpl<const Value*> &Objects,
+                           bool &Any){
+        for (auto &N: Names){
+            if (const GlobalVariable *GV = M->getNamedGlobal(N.getKey())){
+                Objects.insert(GV);
+            } else {
+                Any = true;
+            }
+        }
+    }
+
+    void summarize(Function &F, FunctionModRef &S) const {
+        MemEffects E;
+        for (auto &i: instructions(F)){
+            if (!i.mayReadOrWriteMemory()){
+                continue;
+            }
+            if (LoadInst *LD = dyn_cast<LoadInst>(&i)){
+                AddPointerEffect(LD->getPointerOperand(), true, false, E);
+            }
+            else if (StoreInst *SI = dyn_cast<StoreInst>(&i)){
+                AddPointerEffect(SI->getPointerOperand(), false, true, E);
+            }
+            else if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&i)){
+                AddPointerEffect(RMW->getPointerOperand(), true, true, E);
+            }
+            else if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(&i)){
+                AddPointerEffect(CX->getPointerOperand(), true, true, E);
+            }
+            else if (CallBase *CB = dyn_cast<CallBase>(&i)){
+                addCallEffects(*CB, E);
+            }
+            else {
+                E.ReadsAny = E.WritesAny = true;
+            }
+        }
+
+        S.ReadsAny = E.ReadsAny;
+        S.WritesAny = E.WritesAny;
+        S.ReadArgs.resize(F.arg_size());
+        S.WrittenArgs.resize(F.arg_size());
+        auto Export = [&](const SmallPtrSetImpl<const Value*> &Objects, StringSet<> &Globals,
+                          SmallBitVector &Args, bool &Any){
+            for (const Value *Obj: Objects){
+                if (const Argument *A = dyn_cast<Argument>(Obj)){
+                    Args.set(A->getArgNo());
+                }
+                else if (isa<GlobalVariable>(Obj)){
+                    if (Obj->hasName()){
+                        Globals.insert(Obj->getName());
+                    } else {
+                        Any = true;
+                    }
+                }
+            }
+        };
+        Export(E.Reads, S.ReadGlobals, S.ReadArgs, S.ReadsAny);
+        Export(E.Writes, S.WrittenGlobals, S.WrittenArgs, S.WritesAny);
+    }
+
+public:
+    explicit ModRefSummaries(Module &M){
+        // callees come before their callers, cycles are iterated until the
+        // summaries of the whole SCC are stable
+        CallGraph CG(M);
+        for (scc_iterator<CallGraph*> SCC = scc_begin(&CG); !SCC.isAtEnd(); ++SCC){
+            SmallVector<Function*, 4> Members;
+            for (CallGraphNode *Node: *SCC){
+                Function *F = Node->getFunction();
+                if (!F || F->isDeclaration() || !F->hasName()){
+                    continue;
+                }
+                if (!F->hasExactDefinition() || F->isInterposable()){
+                    // the linker may pick another body, which may touch anything
+                    FunctionModRef &S = Functions[F->getName()];
+                    S.ReadsAny = S.WritesAny = true;
+                    continue;
+                }
+                Members.push_back(F);
+                Functions[F->getName()];
+            }
+
+            bool Changed = true;
+            while (Changed){
+                Changed = false;
+                for (Function *F: Members){
+                    FunctionModRef S;
+                    summarize(*F, S);
+                    FunctionModRef &Old = Functions[F->getName()];
+                    Changed |= S.size() != Old.size();
+                    Old = std::move(S);
+                }
+                Changed &= SCC.hasCycle();
+            }
+        }
+    }
+
+    void addCallEffects(const CallBase &CB, MemEffects &E) const {
+        /* Adds what a call may read or write, mapped onto the objects of the
+         * calling function */
+        if (CB.doesNotAccessMemory()){
+            return;
+        }
+
+        const Function *Callee = CB.getCalledFunction();
+        auto It = Callee && Callee->hasName() ? Functions.find(Callee->getName()) : Functions.end();
+        if (It == Functions.end()){
+            AddCallEffectsFromAttributes(CB, E);
+            return;
+        }
+
+        const FunctionModRef &S = It->second;
+        bool ReadOnly = CB.onlyReadsMemory();
+        const Module *M = CB.getModule();
+        E.ReadsAny |= S.ReadsAny;
+        AddGlobals(M, S.ReadGlobals, E.Reads, E.ReadsAny);
+        for (unsigned a: S.ReadArgs.set_bits()){
+            if (a < CB.arg_size()){
+                AddPointerEffect(CB.getArgOperand(a), true, false, E);
+            }
+        }
+        if (ReadOnly){
+            return;
+        }
+        E.WritesAny |= S.WritesAny;
+        AddGlobals(M, S.WrittenGlobals, E.Writes, E.WritesAny);
+        for (unsigned a: S.WrittenArgs.set_bits()){
+            if (a < CB.arg_size()){
+                AddPointerEffect(CB.getArgOperand(a), false, true, E);
+            }
+        }
+    }
+};
+
+struct AllocaEscapeTracker : public CaptureTracker {
+    /* Capture tracking that also treats passing the pointer to a call as an
+     * escape, since the callee may read or write it through a nocapture
+     * argument */
+    bool Escaped = false;
+
+    void tooManyUses() override { Escaped = true; }
+
+    bool shouldExplore(const Use *U) override {
+        const Instruction *I = cast<Instruction>(U->getUser());
+        if (isa<CallBase>(I) && !I->isLifetimeStartOrEnd() && !isa<DbgInfoIntrinsic>(I)){
+            Escaped = true;
+        }
+        return !Escaped;
+    }
+
+    bool captured(const Use *) override {
+        Escaped = true;
+        return true;
+    }
+};
+
+class LICMAnalysis {
+    /* Computes the function level analyses once and owns them until the
+     * function is done. Loops are put in simplified form once up front, with
+     * the dominator tree, loop info and MemorySSA updated in place. After that
+     * hoisting only moves instructions between existing blocks, so the
+     * dominator tree, loop info and exit blocks stay valid; MemorySSA is
+     * updated as accesses move. */
+    Function &F;
+    const TargetLibraryInfo &TLI;
+    DominatorTree DT;
+    LoopInfo LI;
+    DenseMap<Loop*, SmallVector<BasicBlock*, 8>> ExitBlocks;
+    // allocas that no call can access, computed on first use
+    std::unique_ptr<SmallPtrSet<const Value*, 16>> LocalAllocas;
+
+    std::unique_ptr<AssumptionCache> AC;
+    ScopedNoAliasAAResult ScopedAA;
+    std::unique_ptr<BasicAAResult> BAR;
+    std::unique_ptr<AAResults> AA;
+    std::unique_ptr<MemorySSA> MSSA;
+    std::unique_ptr<MemorySSAUpdater> MSSAU;
+
+    // what calls may read or write, if the module was summarized
+    const ModRefSummaries *ModRef;
+
+    // -licm-typed-aa
+    bool TypedAA = false;
+
+    // loops that loop versioning guarded with runtime alias checks, and
+    // an alias analysis that reads the scopes it put on their accesses
+    SmallPtrSet<const Loop*, 4> Versioned;
+    std::unique_ptr<AAResults> ScopedAAR;
+
+    // the target's register classes for the hoisting cost model, the
+    // estimate of each loop, made on first use, and the cheap instructions
+    // the cost model kept in their loops
+    Optional<TargetTransformInfo> TTI;
+    int RegBudget = -1;
+    DenseMap<const Loop*, std::unique_ptr<RegPressure>> Pressure;
+    SmallPtrSet<const Instruction*, 16> Deferred;
+
+    // per-loop records for -licm-stats-json, if requested
+    FunctionRecord *Report = nullptr;
+    // only when the context streams remarks
+    std::unique_ptr<OptimizationRemarkEmitter> ORE;
+
+public:
+    LICMAnalysis(Function &F, const TargetLibraryInfo &TLI, GlobalsAAResult *GAR, const ModRefSummaries *ModRef)
+        : F(F), TLI(TLI), DT(F), LI(DT), ModRef(ModRef) {
+        // MemorySSA on top of BasicAA, GlobalsAA and the alias scopes of
+        // versioned loops
+        if (GAR && !LI.empty()){
+            AC.reset(new AssumptionCache(F));
+            BAR.reset(new BasicAAResult(F.getParent()->getDataLayout(), F, TLI, *AC, &DT));
+            AA.reset(new AAResults(TLI));
+            AA->addAAResult(*BAR);
+            AA->addAAResult(*GAR);
+            AA->addAAResult(ScopedAA);
+            MSSA.reset(new MemorySSA(F, AA.get(), &DT));
+            MSSAU.reset(new MemorySSAUpdater(MSSA.get()));
+        }
+
+        if (F.getContext().getLLVMRemarkStreamer()){
+            ORE.reset(new OptimizationRemarkEmitter(&F));
+        }
+    }
+
+    Function &getFunction() { return F; }
+    const TargetLibraryInfo &getTLI() { return TLI; }
+    DominatorTree &getDomTree() { return DT; }
+    LoopInfo &getLoopInfo() { return LI; }
+    AAResults *getAA() { return AA.get(); }
+    MemorySSA *getMSSA() { return MSSA.get(); }
+    MemorySSAUpdater *getMSSAUpdater() { return MSSAU.get(); }
+
+    OptimizationRemarkEmitter *getORE() { return ORE.get(); }
+
+    void addCallEffects(const CallBase &CB, MemEffects &E){
+        if (ModRef){
+            ModRef->addCallEffects(CB, E);
+        } else {
+            AddCallEffectsFromAttributes(CB, E);
+        }
+    }
+
+    void setTypedAA(bool Enable) { TypedAA = Enable; }
+    bool useTypedAA() const { return TypedAA; }
+
+    bool isVersioned(const Loop *L) const { return Versioned.count(L); }
+
+    void setCostModel(TargetMachine *TM, int Budget){
+        /* Without a target a fixed -licm-reg-budget still applies to the
+         * register classes of the default TargetTransformInfo */
+        RegBudget = Budget;
+        if (TM){
+            TTI.emplace(TM->getTargetTransformInfo(F));
+        }
+        else if (RegBudget > 0){
+            TTI.emplace(F.getParent()->getDataLayout());
+        }
+    }
+
+    RegPressure *getPressure(const Loop *L){
+        if (!TTI){
+            return nullptr;
+        }
+        std::unique_ptr<RegPressure> &P = Pressure[L];
+        if (!P){
+            P.reset(new RegPressure(*TTI, L, RegBudget));
+        }
+        return P.get();
+    }
+
+    bool defer(const Instruction *I) { return Deferred.insert(I).second; }
+    bool isDeferred(const Instruction *I) const { return Deferred.count(I); }
+
+    bool noAliasInScopes(Instruction *A, Instruction *B){
+        /* Accesses of a versioned loop in different pointer groups */
+        if (Versioned.empty()){
+            return false;
+        }
+        if (!ScopedAAR){
+            ScopedAAR.reset(new AAResults(TLI));
+            ScopedAAR->addAAResult(ScopedAA);
+        }
+        return ScopedAAR->isNoAlias(MemoryLocation::get(A), MemoryLocation::get(B));
+    }
+
+    void loopsVersioned(ArrayRef<Loop*> Loops){
+        /* Loop versioning keeps the dominator tree and loop info up to date,
+         * everything else that looked at the old blocks is recomputed */
+        if (Loops.empty()){
+            return;
+        }
+        Versioned.insert(Loops.begin(), Loops.end());
+        blocksChanged();
+    }
+
+    void loopsUnswitched(){
+        /* Folding the unswitched branches deletes blocks, so the dominator
+         * tree and loop info are computed again and the old loops are gone */
+        DT.recalculate(F);
+        LI.releaseMemory();
+        LI.analyze(DT);
+        Versioned.clear();
+        blocksChanged();
+    }
+
+    void blocksChanged(){
+        /* Drops or recomputes whatever was computed from the old blocks */
+        ExitBlocks.clear();
+        LocalAllocas.reset();
+        Pressure.clear();
+        Deferred.clear();
+        if (MSSA){
+            MSSAU.reset();
+            MSSA.reset(new MemorySSA(F, AA.get(), &DT));
+            MSSAU.reset(new MemorySSAUpdater(MSSA.get()));
+        }
+    }
+
+    void setReport(FunctionRecord *FR) { Report = FR; }
+    LoopRecord *getLoopRecord(const Loop *L) { return Report ? Report->get(L) : nullptr; }
+
+    void simplifyLoops(){
+        // give every loop a preheader, a single backedge and dedicated exits
+        SmallVector<Loop*, 8> Missing;
+        for (Loop *L: LI.getLoopsInPreorder()){
+            if (!L->getLoopPreheader()){
+                Missing.push_back(L);
+            }
+        }
+
+        bool Changed = false;
+        for (Loop *L: LI){
+            Changed |= simplifyLoop(L, &DT, &LI, nullptr, AC.get(), MSSAU.get(), false);
+        }
+
+        if (!Changed){
+            return;
+        }
+        for (Loop *L: Missing){
+            if (L->getLoopPreheader()){
+                LICMPreheaderCreated++;
+            }
+        }
+        ExitBlocks.clear();
+    }
+
+    ArrayRef<BasicBlock*> getExitBlocks(Loop *L){
+        auto It = ExitBlocks.find(L);
+        if (It == ExitBlocks.end()){
+            It = ExitBlocks.insert({L, {}}).first;
+            L->getUniqueExitBlocks(It->second);
+        }
+        return It->second;
+    }
+
+    bool isLocalAlloca(const Value *V){
+        /* Escape analysis runs once over all allocas of the function. Moving
+         * instructions between blocks does not change the result. */
+        if (!LocalAllocas){
+            LocalAllocas.reset(new SmallPtrSet<const Value*, 16>());
+            for (auto &i: instructions(F)){
+                if (isa<AllocaInst>(i)){
+                    AllocaEscapeTracker Tracker;
+                    PointerMayBeCaptured(&i, &Tracker);
+                    if (!Tracker.Escaped){
+                        LocalAllocas->insert(&i);
+                    }
+                }
+            }
+        }
+        return LocalAllocas->count(V);
+    }
+
+    void instructionHoisted(Instruction *I, BasicBlock *PreHeader){
+        // keep MemorySSA in sync when it is being used
+        if (MSSAU){
+            if (MemoryUseOrDef *MA = MSSA->getMemoryAccess(I)){
+                MSSAU->moveToPlace(MA, PreHeader, MemorySSA::BeforeTerminator);
+            }
+        }
+    }
+};
+
+/* Functionality Implementation */
+
+static void hoistInstructionToPreheader(Instruction* I, BasicBlock* PreHeader, LICMAnalysis &AM){
+    /* Move an instruction to the PreHeader*/
+    Instruction *dst = PreHeader->getTerminator();
+    I->moveBefore(dst);
+    AM.instructionHoisted(I, PreHeader);
+}
+
+static bool AreAllOperandsLoopInvaraint(Loop* L, Instruction* I){
+    /* Alternative implementation of hasLoopInvariantOperands */
+    for (auto &op: I->operands()){
+        if (!L->isLoopInvariant(op)){
+             return false;
+        }
+    }
+
+    return true;
+}
+
+static bool dominatesLoopExit(LICMAnalysis &AM, Loop *L, BasicBlock *BB){
+    /* Checks whether a block dominates all the loop exits, i.e. it runs on
+     * every path that leaves the loop */
+    ArrayRef<BasicBlock*> ExitBlocks = AM.getExitBlocks(L);
+
+    if (ExitBlocks.empty()){
+        return false;
+    }
+
+    for (auto *bb: ExitBlocks){
+        bool result = AM.getDomTree().dominates(BB, bb);
+        if (!result){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Bytes of an alloca or a global that an access may touch, relative to the
+ * start of the object */
+struct AccessRange {
+    Value *Base = nullptr;
+    int64_t Begin = 0;
+    int64_t End = 0;
+    Instruction *Access = nullptr;
+
+    bool isWhole() const { return Begin == INT64_MIN; }
+
+    bool overlaps(const AccessRange &Other) const {
+        return Base == Other.Base && Begin < Other.End && Other.Begin < End;
+    }
+};
+
+static bool GetAccessRange(const DataLayout &DL, Value *Ptr, uint64_t Size, bool CArrays, AccessRange &R){
+    /* Walks GEPs and casts from Ptr down to an alloca or a global, adding
+     * up the offsets from the GEP source types. A variable index may reach
+     * the whole object: inbounds only keeps the address inside the object,
+     * not inside the array it indexes. With CArrays (C semantics, under
+     * -licm-typed-aa) a variable index into an array below the first index
+     * of an inbounds GEP stays inside that array. Fails when the pointer is
+     * not based on an alloca or a global. */
+    const int64_t Limit = int64_t(1) << 40;
+    int64_t Lo = 0, Hi = 0;
+    bool Whole = Size > uint64_t(Limit);
+    Value *V = Ptr;
+    while (true){
+        if (GEPOperator *GEP = dyn_cast<GEPOperator>(V)){
+            Type *Agg = nullptr;
+            for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E && !Whole; ++GTI){
+                Value *Idx = GTI.getOperand();
+                if (StructType *STy = GTI.getStructTypeOrNull()){
+                    uint64_t Offset = DL.getStructLayout(STy)->getElementOffset(cast<ConstantInt>(Idx)->getZExtValue());
+                    Lo += Offset;
+                    Hi += Offset;
+                }
+                else if (GTI.getIndexedType()->isSized() && !DL.getTypeAllocSize(GTI.getIndexedType()).isScalable()){
+                    int64_t Stride = DL.getTypeAllocSize(GTI.getIndexedType()).getFixedSize();
+                    ConstantInt *CI = dyn_cast<ConstantInt>(Idx);
+                    if (CI && CI->getValue().getMinSignedBits() <= 24 && Stride < Limit >> 24){
+                        Lo += CI->getSExtValue() * Stride;
+                        Hi += CI->getSExtValue() * Stride;
+                    }
+                    else if (!CI && CArrays && Agg && Agg->isArrayTy() && GEP->isInBounds()
+                             && Agg->getArrayNumElements() < uint64_t(Limit / (Stride + 1))){
+                        Hi += (Agg->getArrayNumElements() - 1) * Stride;
+                    }
+                    else {
+                        Whole = true;
+                    }
+                }
+                else {
+                    Whole = true;
+                }
+                Agg = GTI.getIndexedType();
+                Whole |= Lo < -Limit || Hi > Limit;
+            }
+            V = GEP->getPointerOperand();
+        }
+        else if (isa<BitCastOperator>(V) || isa<AddrSpaceCastOperator>(V)){
+            V = cast<Operator>(V)->getOperand(0);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (!isa<AllocaInst>(V) && !isa<GlobalVariable>(V)){
+        return false;
+    }
+
+    R.Base = V;
+    R.Begin = Whole ? INT64_MIN : Lo;
+    R.End = Whole ? INT64_MAX : Hi + int64_t(Size);
+    return true;
+}
+
+static uint64_t AccessSize(const DataLayout &DL, Type *Ty){
+    TypeSize Size = DL.getTypeStoreSize(Ty);
+    return Size.isScalable() ? UINT64_MAX : Size.getFixedSize();
+}
+
+static Type *StrictAliasClass(Type *Ty){
+    /* The C type an access stands for under strict aliasing. Signed and
+     * unsigned variants share an IR type, and all pointers are one class.
+     * Character and aggregate accesses may alias anything and have none. */
+    if (Ty->isIntegerTy(8) || Ty->isAggregateType() || Ty->isVectorTy()){
+        return nullptr;
+    }
+    if (Ty->isPointerTy()){
+        return Type::getInt8PtrTy(Ty->getContext());
+    }
+    return Ty;
+}
+
+static bool TypesMayAlias(Type *A, Type *B){
+    Type *ClassA = StrictAliasClass(A);
+    Type *ClassB = StrictAliasClass(B);
+    return !ClassA || !ClassB || ClassA == ClassB;
+}
+
+static Value *AccessPointer(Instruction *I){
+    /* The address of a load, store or atomic read-modify-write */
+    if (LoadInst *LD = dyn_cast<LoadInst>(I)){
+        return LD->getPointerOperand();
+    }
+    if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(I)){
+        return RMW->getPointerOperand();
+    }
+    if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(I)){
+        return CX->getPointerOperand();
+    }
+    return cast<StoreInst>(I)->getPointerOperand();
+}
+
+static Type *AccessType(Instruction *I){
+    /* The type of the value it reads or writes */
+    if (isa<LoadInst>(I)){
+        return I->getType();
+    }
+    if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(I)){
+        return RMW->getValOperand()->getType();
+    }
+    if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(I)){
+        return CX->getNewValOperand()->getType();
+    }
+    return cast<StoreInst>(I)->getValueOperand()->getType();
+}
+
+static bool StrictAliasingSeparates(LICMAnalysis &AM, Instruction *Unknown, Instruction *Other){
+    /* Whether -licm-typed-aa tells Unknown, an access through a pointer
+     * with no known object, apart from Other. Accesses of one object are
+     * never told apart by type, since that is how unions are punned, nor
+     * are accesses that alias analysis finds to overlap. */
+    if (!AM.useTypedAA() || TypesMayAlias(AccessType(Unknown), AccessType(Other))){
+        return false;
+    }
+
+    const DataLayout &DL = AM.getFunction().getParent()->getDataLayout();
+    AccessRange R;
+    if (GetAccessRange(DL, AccessPointer(Unknown), AccessSize(DL, AccessType(Unknown)), true, R)){
+        return false;
+    }
+    if (getUnderlyingObject(AccessPointer(Unknown)) == getUnderlyingObject(AccessPointer(Other))){
+        return false;
+    }
+    if (AAResults *AA = AM.getAA()){
+        AliasResult AR = AA->alias(MemoryLocation::get(Unknown), MemoryLocation::get(Other));
+        if (AR == AliasResult::MustAlias || AR == AliasResult::PartialAlias){
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool StoreMayAlias(LICMAnalysis &AM, Instruction *Store, LoadInst *LD){
+    /* Pairwise check for a store whose address says nothing about the load:
+     * strict aliasing under -licm-typed-aa, and the alias scopes of a
+     * versioned loop */
+    if (StrictAliasingSeparates(AM, Store, LD)){
+        return false;
+    }
+    return !AM.noAliasInScopes(Store, LD);
+}
+
+static Instruction *FindAliasingStore(LICMAnalysis &AM, ArrayRef<Instruction*> Stores, LoadInst *LD){
+    for (Instruction *Store: Stores){
+        if (StoreMayAlias(AM, Store, LD)){
+            return Store;
+        }
+    }
+    return nullptr;
+}
+
+/* Memory effects of a loop. Built once per loop and reused by the parent loop
+ * so that load legality checks do not have to rescan the loop body. */
+struct LoopMemSummary {
+    SmallDenseMap<Value*, SmallVector<AccessRange, 2>, 8> StoredBases; // allocas and globals stored to, and the stores
+    bool hasMayAliasStore = false;      // store through any other pointer
+    SmallVector<Instruction*, 8> Stores;          // all stores, for pairwise checks
+    SmallVector<Instruction*, 4> MayAliasStores;  // the subset through other pointers
+    bool hasStore = false;
+    bool hasCall = false;                 // call that may touch memory, throw or not return
+    bool hasWritingCall = false;          // subset of those that may write memory
+    bool hasPureCall = false;             // readnone, nounwind and willreturn calls
+    bool hasMayThrow = false;             // instruction that may throw or not return
+    MemEffects CallEffects;               // memory the calls may read or write
+
+    // representative instructions behind the flags above, for remarks
+    Instruction *FirstStore = nullptr;
+    Instruction *BlockingCall = nullptr;
+    Instruction *WritingCall = nullptr;
+};
+
+typedef DenseMap<Loop*, LoopMemSummary> LoopSummaryMap;
+
+static void MergeLoopSummary(LoopMemSummary &Dst, const LoopMemSummary &Src){
+    for (auto &B: Src.StoredBases){
+        Dst.StoredBases[B.first].append(B.second.begin(), B.second.end());
+    }
+    Dst.hasMayAliasStore |= Src.hasMayAliasStore;
+    Dst.Stores.append(Src.Stores.begin(), Src.Stores.end());
+    Dst.MayAliasStores.append(Src.MayAliasStores.begin(), Src.MayAliasStores.end());
+    Dst.hasStore |= Src.hasStore;
+    Dst.hasCall |= Src.hasCall;
+    Dst.hasWritingCall |= Src.hasWritingCall;
+    Dst.hasPureCall |= Src.hasPureCall;
+    Dst.hasMayThrow |= Src.hasMayThrow;
+    Dst.CallEffects.merge(Src.CallEffects);
+    Dst.FirstStore = Dst.FirstStore ? Dst.FirstStore : Src.FirstStore;
+    Dst.BlockingCall = Dst.BlockingCall ? Dst.BlockingCall : Src.BlockingCall;
+    Dst.WritingCall = Dst.WritingCall ? Dst.WritingCall : Src.WritingCall;
+}
+
+static bool IsPureCall(const CallBase *CI){
+    /* A call without any effect other than computing its result */
+    return CI->doesNotAccessMemory() && CI->doesNotThrow() && CI->willReturn();
+}
+
+static void SummarizeLoop(LICMAnalysis &AM, Loop *L, LoopSummaryMap &Summaries){
+    /* Merges the current summaries of the subloops of L and scans only the
+     * blocks that belong to L directly */
+    LoopInfo &LI = AM.getLoopInfo();
+    const DataLayout &DL = AM.getFunction().getParent()->getDataLayout();
+    LoopMemSummary Summary;
+    for (auto subloop: L->getSubLoops()){
+        MergeLoopSummary(Summary, Summaries[subloop]);
+    }
+
+    for (auto *bb: L->blocks()){
+        if (LI.getLoopFor(bb) != L){
+            continue;
+        }
+        for (auto &i: *bb){
+            // atomic read-modify-writes write memory like stores
+            if (isa<StoreInst>(i) || isa<AtomicRMWInst>(i) || isa<AtomicCmpXchgInst>(i)){
+                Value *addr_of_store = AccessPointer(&i);
+                Summary.hasStore = true;
+                Summary.Stores.push_back(&i);
+                if (!Summary.FirstStore){
+                    Summary.FirstStore = &i;
+                }
+                // different address - if it's not based on an alloca or a
+                // global varible it could be storing to any address
+                AccessRange R;
+                if (GetAccessRange(DL, addr_of_store, AccessSize(DL, AccessType(&i)), AM.useTypedAA(), R)){
+                    R.Access = &i;
+                    Summary.StoredBases[R.Base].push_back(R);
+                } else {
+                    Summary.hasMayAliasStore = true;
+                    Summary.MayAliasStores.push_back(&i);
+                }
+            }
+
+            if (!isGuaranteedToTransferExecutionToSuccessor(&i)){
+                Summary.hasMayThrow = true;
+            }
+
+            // a fence orders every access around it, like a call that may
+            // write anything
+            if (isa<FenceInst>(i)){
+                Summary.hasCall = Summary.hasWritingCall = true;
+                Summary.CallEffects.ReadsAny = Summary.CallEffects.WritesAny = true;
+                if (!Summary.BlockingCall){
+                    Summary.BlockingCall = &i;
+                }
+                if (!Summary.WritingCall){
+                    Summary.WritingCall = &i;
+                }
+            }
+
+            // invokes and callbrs touch memory like calls
+            if (CallBase *CI = dyn_cast<CallBase>(&i)){
+                if (IsPureCall(CI)){
+                    Summary.hasPureCall = true;
+                } else {
+                    Summary.hasCall = true;
+                    Summary.hasWritingCall |= !CI->onlyReadsMemory();
+                    AM.addCallEffects(*CI, Summary.CallEffects);
+                    if (!Summary.BlockingCall){
+                        Summary.BlockingCall = CI;
+                    }
+                    if (!Summary.WritingCall && !CI->onlyReadsMemory()){
+                        Summary.WritingCall = CI;
+                    }
+                }
+            }
+        }
+    }
+
+    Summaries[L] = std::move(Summary);
+}
+
+static void BuildLoopSummary(LICMAnalysis &AM, Loop *L, LoopSummaryMap &Summaries){
+    /* Summaries are built bottom-up, so every loop is scanned once. They
+     * point at the stores and calls of the loop: whatever erases those, such
+     * as promotion, has to build them again. */
+    for (auto subloop: L->getSubLoops()){
+        BuildLoopSummary(AM, subloop, Summaries);
+    }
+    SummarizeLoop(AM, L, Summaries);
+}
+
+static bool NoPossibleStoresToAnyAddressInLoop(const LoopMemSummary &Summary){
+    return !Summary.hasStore && !Summary.hasCall;
+}
+
+static Instruction *FindStoreTo(const LoopMemSummary &Summary, const AccessRange &R){
+    /* A store of the loop to the same object whose bytes overlap R */
+    auto It = Summary.StoredBases.find(R.Base);
+    if (It == Summary.StoredBases.end()){
+        return nullptr;
+    }
+    for (const AccessRange &Stored: It->second){
+        if (Stored.overlaps(R)){
+            return Stored.Access;
+        }
+    }
+    return nullptr;
+}
+
+static Instruction *MayAliasStoreTo(LICMAnalysis &AM, const LoopMemSummary &Summary, LoadInst *LD){
+    /* A store through an unknown pointer that may write what LD reads */
+    return FindAliasingStore(AM, Summary.MayAliasStores, LD);
+}
+
+static bool NoPossibleStoresToAddressInLoop(LICMAnalysis &AM, const LoopMemSummary &Summary, LoadInst *LD){
+    //no possible stores to addr in L
+    if (MayAliasStoreTo(AM, Summary, LD)){
+        return false;
+    }
+
+    // only loads from an alloca or a global can be told apart from the stores
+    const DataLayout &DL = AM.getFunction().getParent()->getDataLayout();
+    AccessRange R;
+    if (!GetAccessRange(DL, LD->getPointerOperand(), AccessSize(DL, LD->getType()), AM.useTypedAA(), R)){
+        return false;
+    }
+
+    // calls only reach allocas whose address escapes, and only the memory
+    // their summaries name
+    if (Summary.hasCall && !AM.isLocalAlloca(R.Base) && MayWrite(Summary.CallEffects, R.Base)){
+        return false;
+    }
+
+    //after all of this - this is a safe load
+    return !FindStoreTo(Summary, R);
+}
+
+static bool isGuaranteedToExecute(LICMAnalysis &AM, Loop *L, const LoopMemSummary &Summary, Instruction *I){
+    /* Checks whether I runs whenever the loop is entered. Anything in the
+     * header runs unless an earlier header instruction throws or does not
+     * return; anything else must dominate every exit of a loop in which no
+     * instruction can leave abnormally. */
+    BasicBlock *Header = L->getHeader();
+    if (I->getParent() == Header){
+        for (auto &i: *Header){
+            if (&i == I){
+                return true;
+            }
+            if (!isGuaranteedToTransferExecutionToSuccessor(&i)){
+                return false;
+            }
+        }
+    }
+
+    if (Summary.hasMayThrow){
+        return false;
+    }
+
+    return dominatesLoopExit(AM, L, I->getParent());
+}
+
+static bool isDereferenceableInPreheader(LICMAnalysis &AM, Loop *L, LoadInst *LD){
+    /* Checks whether the load can run in the preheader without faulting,
+     * even on a path where the loop would not have executed it */
+    if (mustSuppressSpeculation(*LD)){
+        return false;
+    }
+
+    const DataLayout &DL = AM.getFunction().getParent()->getDataLayout();
+    return isDereferenceableAndAlignedPointer(LD->getPointerOperand(), LD->getType(), LD->getAlign(), DL,
+                                              L->getLoopPreheader()->getTerminator(), &AM.getDomTree());
+}
+
+static bool ClobberedInLoop(MemorySSA *MSSA, Loop *L, Instruction *I){
+    /* Checks whether the nearest access that may clobber I is inside the loop */
+    MemoryAccess *Clobber = MSSA->getWalker()->getClobberingMemoryAccess(I);
+    if (MSSA->isLiveOnEntryDef(Clobber)){
+        return false;
+    }
+
+    return L->contains(Clobber->getBlock());
+}
+
+static bool AllocaNotInLoop(Loop *L, Value *Addr){
+    Instruction *x = dyn_cast<AllocaInst>(Addr);
+    BasicBlock *parent = x->getParent();
+
+    if (L->contains(parent)){
+        return false;
+    }
+
+    return true;
+}
+
+static bool CanMoveOutofLoop(LICMAnalysis &AM, Loop *L, Instruction* I, Value* LoadAddress, const LoopMemSummary &Summary){
+    /* Determines whether an instruction can be moved out of a loop
+     * */
+
+    // Case 1: instruction marked volatile, or atomic with an ordering that
+    // waits for other threads - cannot be moved out of the loop, whatever
+    // the address
+    LoadInst *LD = cast<LoadInst>(I);
+    if (!LD->isUnordered()){
+        return false;
+    }
+
+    if (isa<GlobalVariable>(LoadAddress) && NoPossibleStoresToAddressInLoop(AM, Summary, LD)){
+
+        return true;
+    }
+
+    if (isa<AllocaInst>(LoadAddress)
+        && AllocaNotInLoop(L, LoadAddress)
+        && NoPossibleStoresToAddressInLoop(AM, Summary, LD)){
+   
+        return true;
+    }
+
+    // Any other loop-invariant address must be safe to read in the
+    // preheader: either the load runs whenever the loop is entered or the
+    // address is known to be dereferenceable there
+    if (!L->isLoopInvariant(LoadAddress)
+        || !(isGuaranteedToExecute(AM, L, Summary, I) || isDereferenceableInPreheader(AM, L, LD))){
+        return false;
+    }
+
+    // With MemorySSA, any load whose clobbering access lies outside the loop
+    // reads the same value on every iteration
+    MemorySSA *MSSA = AM.getMSSA();
+    if (MSSA && !ClobberedInLoop(MSSA, L, I)){
+        return true;
+    }
+
+    // Without it, nothing in the loop may write memory, or at least not
+    // the bytes of the alloca or global the load reads
+    if (NoPossibleStoresToAnyAddressInLoop(Summary) || NoPossibleStoresToAddressInLoop(AM, Summary, LD)){
+        return true;
+    }
+
+    // Nor does a loop whose stores are each known not to alias the load,
+    // and whose calls do not write memory the load may read
+    if (!FindAliasingStore(AM, Summary.Stores, LD)
+        && !(Summary.hasCall && MayWrite(Summary.CallEffects, LoadAddress))){
+        return true;
+    }
+
+    return false;
+}
+
+static bool CanHoistCall(LICMAnalysis &AM, Loop *L, CallInst *CI, const LoopMemSummary &Summary){
+    /* Calls to readnone functions can be hoisted like any other invariant
+     * computation; calls to readonly functions only when nothing in the
+     * loop writes memory */
+    if (CI->isInlineAsm() || CI->isConvergent() || CI->isMustTailCall() || isa<DbgInfoIntrinsic>(CI)){
+        return false;
+    }
+
+    if (!CI->doesNotThrow() || !CI->willReturn()){
+        return false;
+    }
+
+    if (!CI->doesNotAccessMemory()
+        && !(CI->onlyReadsMemory() && !Summary.hasStore && !Summary.hasWritingCall)){
+        return false;
+    }
+
+    if (!AreAllOperandsLoopInvaraint(L, CI)){
+        return false;
+    }
+
+    // the call must not run on a path where it did not run before, unless
+    // it is known to be free of undefined behavior for any argument
+    return isSafeToSpeculativelyExecute(CI) || isGuaranteedToExecute(AM, L, Summary, CI);
+}
+
+static void updateStats(bool hasLoad, bool hasStore){
+    if (!hasStore && hasLoad){
+        NumLoopsNoStoreWithLoad++;
+    } else if (!hasLoad){
+        NumLoopsNoLoad++;
+    } else if (!hasStore){
+        NumLoopsNoStore++;
+    }
+}
+
+static bool NotALoadOrStore(Instruction* I){
+    if (isa<LoadInst>(I)){
+        return false;
+    }
+    if (isa<StoreInst>(I)){
+        return false;
+    }
+    return true;
+}
+
+/* Worklist over every instruction of a loop. Instructions are numbered in
+ * reverse post-order of the loop body and the queue is a bitset over those
+ * numbers that is drained in ascending order, sweeping again from the top
+ * until it is empty. The hoisting order therefore only depends on the IR. */
+class LoopWorklist {
+    std::vector<Instruction*> Insts;
+    DenseMap<Instruction*, unsigned> Index;
+    BitVector Queued;
+    int Cursor = -1;
+
+public:
+    LoopWorklist(Loop *L, LoopInfo &LI){
+        LoopBlocksRPO RPOT(L);
+        RPOT.perform(&LI);
+        for (BasicBlock *bb: RPOT){
+            for (auto &i: *bb){
+                Index[&i] = Insts.size();
+                Insts.push_back(&i);
+            }
+        }
+        Queued.resize(Insts.size(), true);
+    }
+
+    Instruction *pop(){
+        int idx = Cursor < 0 ? Queued.find_first() : Queued.find_next(Cursor);
+        if (idx < 0){
+            // start the next sweep
+            idx = Queued.find_first();
+        }
+        if (idx < 0){
+            return nullptr;
+        }
+
+        Queued.reset(idx);
+        Cursor = idx;
+        return Insts[idx];
+    }
+
+    void push(Instruction *I){
+        auto It = Index.find(I);
+        if (It != Index.end()){
+            Queued.set(It->second);
+        }
+    }
+
+    void pushUsers(Instruction *I){
+        /* Users of a hoisted instruction may have become invariant */
+        for (User *U: I->users()){
+            if (Instruction *UI = dyn_cast<Instruction>(U)){
+                push(UI);
+            }
+        }
+    }
+};
+
+/* Rewrites the loads and stores of one promoted location into SSA values and
+ * stores the final value back in every exit block */
+class LoopPromoter : public LoadAndStorePromoter {
+    Value *SomePtr;
+    SmallVectorImpl<BasicBlock*> &ExitBlocks;
+    MemorySSAUpdater *MSSAU;
+    Align Alignment;
+
+public:
+    LoopPromoter(Value *SP, ArrayRef<const Instruction*> Insts, SSAUpdater &S,
+                 SmallVectorImpl<BasicBlock*> &EB, MemorySSAUpdater *MSSAU, Align A)
+        : LoadAndStorePromoter(Insts, S), SomePtr(SP), ExitBlocks(EB), MSSAU(MSSAU), Alignment(A) {}
+
+    void doExtraRewritesBeforeFinalDeletion() override {
+        for (BasicBlock *ExitBlock: ExitBlocks){
+            Value *LiveInValue = SSA.GetValueInMiddleOfBlock(ExitBlock);
+            StoreInst *NewSI = new StoreInst(LiveInValue, SomePtr, &*ExitBlock->getFirstInsertionPt());
+            NewSI->setAlignment(Alignment);
+
+            if (MSSAU){
+                MemoryAccess *NewMemAcc = MSSAU->createMemoryAccessInBB(NewSI, nullptr, ExitBlock, MemorySSA::Beginning);
+                MSSAU->insertDef(cast<MemoryDef>(NewMemAcc), true);
+            }
+        }
+    }
+
+    void instructionDeleted(Instruction *I) const override {
+        if (MSSAU){
+            MSSAU->removeMemoryAccess(I);
+        }
+    }
+};
+
+static bool PromotedAccessesMayAlias(LICMAnalysis &AM, Value *Ptr, Instruction *Access, Instruction *Other){
+    /* Checks whether Other may touch the location that is being promoted */
+    if (StrictAliasingSeparates(AM, Other, Access)){
+        return false;
+    }
+    if (AM.noAliasInScopes(Access, Other)){
+        return false;
+    }
+    if (AAResults *AA = AM.getAA()){
+        return !AA->isNoAlias(MemoryLocation::get(Access), MemoryLocation::get(Other));
+    }
+
+    // without alias analysis only distinct allocas and globals are known to
+    // be disjoint
+    Value *Base = getUnderlyingObject(AccessPointer(Other));
+    if (Base == Ptr || (!isa<AllocaInst>(Ptr) && !isa<GlobalVariable>(Ptr))){
+        return true;
+    }
+    return !isa<AllocaInst>(Base) && !isa<GlobalVariable>(Base);
+}
+
+static bool PromoteLoopMemory(LICMAnalysis &AM, Loop *L, BasicBlock *PH, const LoopMemSummary &Summary){
+    /* Scalar promotion: a loop-invariant location that is only accessed
+     * through one pointer is loaded in the preheader, carried in registers
+     * through the loop and stored back at the exits. Returns whether any
+     * location was promoted, which erases loads and stores of L. */
+    if (!Summary.hasStore || !L->hasDedicatedExits()){
+        return false;
+    }
+
+    SmallVector<BasicBlock *, 8> ExitBlocks(AM.getExitBlocks(L).begin(), AM.getExitBlocks(L).end());
+    for (auto *bb: ExitBlocks){
+        if (bb->getFirstInsertionPt() == bb->end()){
+            return false;
+        }
+    }
+
+    // group the memory accesses of the loop by their pointer operand; atomic
+    // read-modify-writes are never promoted and block any location they may
+    // touch, anything else that accesses memory outside a call blocks all
+    MapVector<Value*, SmallVector<Instruction*, 4>> Groups;
+    SmallVector<Instruction*, 32> Accesses;
+    SmallVector<Instruction*, 4> Atomics;
+    for (auto *bb: L->blocks()){
+        for (auto &i: *bb){
+            if (isa<LoadInst>(i) || isa<StoreInst>(i)){
+                Groups[AccessPointer(&i)].push_back(&i);
+                Accesses.push_back(&i);
+            }
+            else if (isa<AtomicRMWInst>(i) || isa<AtomicCmpXchgInst>(i)){
+                Atomics.push_back(&i);
+            }
+            else if (i.mayReadOrWriteMemory() && !isa<CallBase>(i)){
+                return false;
+            }
+        }
+    }
+
+    const DataLayout &DL = AM.getFunction().getParent()->getDataLayout();
+    DominatorTree *DT = &AM.getDomTree();
+    AAResults *AA = AM.getAA();
+    MemorySSAUpdater *MSSAU = AM.getMSSAUpdater();
+    bool Promoted = false;
+    for (auto &G: Groups){
+        Value *Ptr = G.first;
+        SmallVector<Instruction*, 4> &Insts = G.second;
+
+        // other pointers need alias analysis, or the alias scopes of a
+        // versioned loop
+        if (!L->isLoopInvariant(Ptr) || (!AA && !AM.isVersioned(L) && !isa<AllocaInst>(Ptr) && !isa<GlobalVariable>(Ptr))){
+            continue;
+        }
+
+        // no call in the loop may access the location
+        if (Summary.hasCall && !AM.isLocalAlloca(Ptr)
+            && (MayRead(Summary.CallEffects, Ptr) || MayWrite(Summary.CallEffects, Ptr))){
+            continue;
+        }
+
+        bool promotable = true, hasStore = false, guaranteedStore = false, guaranteedAccess = false;
+        Type *Ty = AccessType(Insts[0]);
+        Align Alignment = isa<LoadInst>(Insts[0]) ? cast<LoadInst>(Insts[0])->getAlign()
+                                                 : cast<StoreInst>(Insts[0])->getAlign();
+        for (auto *i: Insts){
+            bool simple = isa<LoadInst>(i) ? cast<LoadInst>(i)->isSimple() : cast<StoreInst>(i)->isSimple();
+            if (!simple || AccessType(i) != Ty){
+                promotable = false;
+                break;
+            }
+
+            Align A = isa<LoadInst>(i) ? cast<LoadInst>(i)->getAlign() : cast<StoreInst>(i)->getAlign();
+            Alignment = std::min(Alignment, A);
+
+            bool guaranteed = isGuaranteedToExecute(AM, L, Summary, i);
+            guaranteedAccess |= guaranteed;
+            if (isa<StoreInst>(i)){
+                hasStore = true;
+                guaranteedStore |= guaranteed;
+            }
+        }
+
+        if (!promotable || !hasStore){
+            continue;
+        }
+
+        // nothing else in the loop may read or write the location
+        for (auto *other: Accesses){
+            if (AccessPointer(other) != Ptr && PromotedAccessesMayAlias(AM, Ptr, Insts[0], other)){
+                promotable = false;
+                break;
+            }
+        }
+        for (auto *other: Atomics){
+            if (PromotedAccessesMayAlias(AM, Ptr, Insts[0], other)){
+                promotable = false;
+                break;
+            }
+        }
+
+        if (!promotable){
+            continue;
+        }
+
+        // the preheader load must not fault, and the exit stores must not
+        // write memory that another thread could observe
+        if (!guaranteedAccess
+            && !isDereferenceableAndAlignedPointer(Ptr, Ty, Alignment, DL, PH->getTerminator(), DT)){
+            continue;
+        }
+
+        if (!guaranteedStore
+            && !(isa<AllocaInst>(Ptr) && !PointerMayBeCaptured(Ptr, true, true))){
+            continue;
+        }
+
+        SmallVector<PHINode*, 16> NewPHIs;
+        SSAUpdater SSA(&NewPHIs);
+        LoopPromoter Promoter(Ptr, ArrayRef<const Instruction*>(Insts.begin(), Insts.end()),
+                              SSA, ExitBlocks, MSSAU, Alignment);
+
+        LoadInst *PreheaderLoad = new LoadInst(Ty, Ptr, Ptr->getName() + ".promoted",
+                                               false, Alignment, PH->getTerminator());
+        if (MSSAU){
+            MemoryAccess *PreLoadMA = MSSAU->createMemoryAccessInBB(PreheaderLoad, nullptr, PH, MemorySSA::End);
+            MSSAU->insertUse(cast<MemoryUse>(PreLoadMA), true);
+        }
+        SSA.AddAvailableValue(PH, PreheaderLoad);
+
+        // the promoted accesses are deleted, later groups must not look at them
+        erase_if(Accesses, [&Insts](Instruction *i){ return is_contained(Insts, i); });
+
+        if (OptimizationRemarkEmitter *ORE = AM.getORE()){
+            ORE->emit([&]{
+                return OptimizationRemark("p3-licm", "Promoted", Insts[0])
+                       << "promoted " << ore::NV("Location", Ptr) << " to a register in loop "
+                       << ore::NV("Loop", LoopTraceDetail(L));
+            });
+        }
+
+        SmallVector<Instruction*, 4> LoopUses(Insts.begin(), Insts.end());
+        Promoter.run(LoopUses);
+
+        if (PreheaderLoad->use_empty()){
+            if (MSSAU){
+                MSSAU->removeMemoryAccess(PreheaderLoad);
+            }
+            PreheaderLoad->eraseFromParent();
+        }
+
+        Promoted = true;
+        LICMPromoted++;
+        if (LoopRecord *R = AM.getLoopRecord(L)){
+            R->Promoted++;
+        }
+    }
+    return Promoted;
+}
+
+static void RecordHoist(LICMAnalysis &AM, Loop *L, Instruction *I){
+    /* Accounts for an instruction that was moved to the preheader of L */
+    if (LoopRecord *R = AM.getLoopRecord(L)){
+        R->Hoisted++;
+        if (isa<LoadInst>(I)){
+            R->LoadsHoisted++;
+        }
+        else if (isa<CallInst>(I)){
+            R->CallsHoisted++;
+        }
+    }
+
+    if (OptimizationRemarkEmitter *ORE = AM.getORE()){
+        ORE->emit([&]{
+            return OptimizationRemark("p3-licm", "Hoisted", I)
+                   << "hoisted " << ore::NV("Inst", I) << " out of loop "
+                   << ore::NV("Loop", LoopTraceDetail(L));
+        });
+    }
+}
+
+static RejectReason WhyNotHoisted(LICMAnalysis &AM, Loop *L, Instruction *I, const LoopMemSummary &Summary,
+                                  Instruction *&Blocker){
+    /* Best guess at what kept I in the loop, and the instruction responsible
+     * when there is one */
+    Blocker = nullptr;
+    if (I->isVolatile() || (isa<LoadInst>(I) && !cast<LoadInst>(I)->isUnordered())){
+        return RejectVolatile;
+    }
+    if (!AreAllOperandsLoopInvaraint(L, I)){
+        for (auto &op: I->operands()){
+            if (!L->isLoopInvariant(op)){
+                Blocker = dyn_cast<Instruction>(op);
+                break;
+            }
+        }
+        return RejectVariant;
+    }
+    if (AM.isDeferred(I)){
+        return RejectRegPressure;
+    }
+
+    if (LoadInst *LD = dyn_cast<LoadInst>(I)){
+        if (MemorySSA *MSSA = AM.getMSSA()){
+            MemoryAccess *Clobber = MSSA->getWalker()->getClobberingMemoryAccess(I);
+            if (MSSA->isLiveOnEntryDef(Clobber) || !L->contains(Clobber->getBlock())){
+                return RejectUnsafe;
+            }
+            auto *Def = dyn_cast<MemoryDef>(Clobber);
+            if (!Def){
+                return RejectStoreAlias;
+            }
+            Blocker = Def->getMemoryInst();
+            return isa<CallBase>(Blocker) ? RejectCall : RejectStoreAlias;
+        }
+        const DataLayout &DL = AM.getFunction().getParent()->getDataLayout();
+        AccessRange R;
+        bool Identified = GetAccessRange(DL, LD->getPointerOperand(), AccessSize(DL, LD->getType()), AM.useTypedAA(), R);
+        bool CallMayWrite = Identified ? !AM.isLocalAlloca(R.Base) && MayWrite(Summary.CallEffects, R.Base)
+                                       : MayWrite(Summary.CallEffects, LD->getPointerOperand());
+        if (Summary.hasCall && CallMayWrite){
+            Blocker = Summary.BlockingCall;
+            return RejectCall;
+        }
+
+        // the store that makes NoPossibleStoresToAddressInLoop fail
+        if (Instruction *Store = MayAliasStoreTo(AM, Summary, LD)){
+            Blocker = Store;
+            return RejectStoreAlias;
+        }
+        if (Identified){
+            Blocker = FindStoreTo(Summary, R);
+        }
+        else if (Summary.hasStore){
+            Blocker = FindAliasingStore(AM, Summary.Stores, LD);
+        }
+        return Blocker ? RejectStoreAlias : RejectUnsafe;
+    }
+
+    if (CallInst *CI = dyn_cast<CallInst>(I)){
+        if (!CI->onlyReadsMemory()){
+            return RejectCall;
+        }
+        if (Summary.hasWritingCall){
+            Blocker = Summary.WritingCall;
+            return RejectCall;
+        }
+        if (!CI->doesNotAccessMemory() && Summary.hasStore){
+            Blocker = Summary.FirstStore;
+            return RejectStoreAlias;
+        }
+    }
+    return RejectUnsafe;
+}
+
+static void RecordRejections(LICMAnalysis &AM, Loop *L, const LoopMemSummary *Summary){
+    /* Counts the candidates left in the blocks that belong to L itself and
+     * explains the loads and calls among them in missed remarks; without a
+     * summary the loop was skipped for lack of a preheader */
+    LoopRecord *R = AM.getLoopRecord(L);
+    OptimizationRemarkEmitter *ORE = AM.getORE();
+    if (!R && !ORE){
+        return;
+    }
+
+    static const char *Explanation[NumRejectReasons] = {
+        "it is volatile or atomic",
+        "a store in the loop may write the location",
+        "a call in the loop may write memory",
+        "the loop has no preheader",
+        "an operand changes in the loop",
+        "it may not be safe to execute before the loop",
+        "hoisting it would need more registers than the loop has"
+    };
+
+    LoopInfo &LI = AM.getLoopInfo();
+    for (BasicBlock *bb: L->blocks()){
+        if (LI.getLoopFor(bb) != L){
+            continue;
+        }
+        for (auto &i: *bb){
+            if (isa<PHINode>(&i) || i.isTerminator() || isa<StoreInst>(&i) || isa<DbgInfoIntrinsic>(&i)){
+                continue;
+            }
+
+            Instruction *Blocker = nullptr;
+            RejectReason Reason = Summary ? WhyNotHoisted(AM, L, &i, *Summary, Blocker) : RejectNoPreheader;
+            if (R){
+                R->Rejected[Reason]++;
+            }
+
+            if (!ORE || !(isa<LoadInst>(&i) || isa<CallInst>(&i) || Reason == RejectRegPressure)){
+                continue;
+            }
+            ORE->emit([&]{
+                OptimizationRemarkMissed Remark("p3-licm", "NotHoisted", &i);
+                Remark << "not hoisted " << ore::NV("Inst", &i) << " because "
+                       << ore::NV("Reason", RejectReasonNames[Reason]) << ": " << Explanation[Reason];
+                if (Blocker){
+                    std::string Printed;
+                    raw_string_ostream OS(Printed);
+                    Blocker->print(OS);
+                    Remark << "; blocked by " << ore::NV("Blocker", Blocker)
+                           << " (" << ore::NV("BlockerIR", StringRef(OS.str()).trim()) << ")";
+                }
+                return Remark;
+            });
+        }
+    }
+}
+
+static bool IsInvariantAddress(Loop *L, Value *V){
+    /* Invariant already, or once the address arithmetic in the loop is
+     * hoisted */
+    if (L->isLoopInvariant(V)){
+        return true;
+    }
+    if (!isa<GetElementPtrInst>(V) && !isa<CastInst>(V)){
+        return false;
+    }
+    for (Value *Op: cast<Instruction>(V)->operands()){
+        if (!IsInvariantAddress(L, Op)){
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool WorthVersioning(LICMAnalysis &AM, Loop *L){
+    /* Checks whether a loop without calls has an invariant load that only
+     * the stores of the loop keep inside, or an invariant store through a
+     * pointer that only a no-alias guarantee would let it promote */
+    LoopSummaryMap Summaries;
+    BuildLoopSummary(AM, L, Summaries);
+    const LoopMemSummary &Summary = Summaries[L];
+    if (!Summary.hasStore || Summary.hasCall){
+        return false;
+    }
+
+    MemorySSA *MSSA = AM.getMSSA();
+    for (auto *bb: L->blocks()){
+        for (auto &i: *bb){
+            if (LoadInst *LD = dyn_cast<LoadInst>(&i)){
+                if (!LD->isSimple() || !IsInvariantAddress(L, LD->getPointerOperand())
+                    || !dominatesLoopExit(AM, L, bb)){
+                    continue;
+                }
+                bool Clobbered = MSSA ? ClobberedInLoop(MSSA, L, LD)
+                                      : !NoPossibleStoresToAddressInLoop(AM, Summary, LD)
+                                        && FindAliasingStore(AM, Summary.Stores, LD);
+                if (Clobbered){
+                    return true;
+                }
+            }
+            else if (StoreInst *SI = dyn_cast<StoreInst>(&i)){
+                Value *Ptr = SI->getPointerOperand();
+                if (SI->isSimple() && IsInvariantAddress(L, Ptr)
+                    && (Summary.hasMayAliasStore || (!isa<AllocaInst>(Ptr) && !isa<GlobalVariable>(Ptr)))){
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+static void VersionLoopsWithAliasChecks(LICMAnalysis &AM, unsigned MaxSize){
+    /* Loop versioning: an innermost loop that keeps invariant memory
+     * accesses only because its pointers may overlap gets a copy guarded by
+     * runtime checks, built from the SCEV bounds of each pointer, that the
+     * accessed ranges are disjoint. The checked copy is the original loop,
+     * with alias scopes on its accesses that later checks read; the clone
+     * runs when the ranges do overlap. */
+    Function &F = AM.getFunction();
+    LoopInfo &LI = AM.getLoopInfo();
+    DominatorTree &DT = AM.getDomTree();
+
+    SmallVector<Loop*, 4> Candidates;
+    for (Loop *L: LI.getLoopsInPreorder()){
+        unsigned Size = 0;
+        for (auto *bb: L->blocks()){
+            Size += bb->size();
+        }
+        if (L->isInnermost() && L->getLoopPreheader() && L->getExitingBlock() && L->getExitBlock()
+            && Size <= MaxSize && WorthVersioning(AM, L)){
+            Candidates.push_back(L);
+        }
+    }
+    if (Candidates.empty()){
+        return;
+    }
+
+    // LoopAccessInfo wants mutable analyses of its own
+    TargetLibraryInfo VTLI(AM.getTLI());
+    AssumptionCache AC(F);
+    ScalarEvolution SE(F, VTLI, AC, DT, LI);
+    BasicAAResult BAR(F.getParent()->getDataLayout(), F, VTLI, AC, &DT);
+    AAResults AA(VTLI);
+    AA.addAAResult(BAR);
+
+    SmallVector<Loop*, 4> Versioned;
+    for (Loop *L: Candidates){
+        TimeTraceScope VersionScope("LICMVersion", [&]{ return LoopTraceDetail(L); });
+        LoopAccessInfo LAI(L, &SE, &VTLI, &AA, &DT, &LI);
+        const RuntimePointerChecking *Checks = LAI.getRuntimePointerChecking();
+        if (Checks->getChecks().empty() || LAI.hasConvergentOp()
+            || LAI.getNumRuntimePointerChecks() > VectorizerParams::RuntimeMemoryCheckThreshold){
+            continue;
+        }
+
+        formLCSSA(*L, DT, &LI, &SE);
+        LoopVersioning LVer(LAI, Checks->getChecks(), L, &LI, &DT, &SE);
+        LVer.versionLoop();
+        LVer.annotateLoopWithNoAlias();
+        Versioned.push_back(L);
+        LICMVersionedLoops++;
+
+        if (OptimizationRemarkEmitter *ORE = AM.getORE()){
+            ORE->emit([&]{
+                return OptimizationRemark("p3-licm", "Versioned", L->getStartLoc(), L->getHeader())
+                       << "versioned loop " << ore::NV("Loop", LoopTraceDetail(L)) << " behind "
+                       << ore::NV("Checks", LAI.getNumRuntimePointerChecks()) << " runtime alias checks";
+            });
+        }
+    }
+
+    AM.loopsVersioned(Versioned);
+}
+
+static bool CanSinkFrom(LICMAnalysis &AM, Loop *L, Instruction *I, const LoopMemSummary &Summary){
+    /* Checks whether I computes the same value in an exit of L as it did
+     * in the last iteration */
+    if (isa<PHINode>(I) || I->isTerminator() || I->isEHPad() || isa<AllocaInst>(I)
+        || I->getType()->isTokenTy() || I->mayHaveSideEffects()){
+        return false;
+    }
+
+    if (CallInst *CI = dyn_cast<CallInst>(I)){
+        return IsPureCall(CI) && !CI->isInlineAsm() && !CI->isConvergent() && !isa<DbgInfoIntrinsic>(CI);
+    }
+
+    LoadInst *LD = dyn_cast<LoadInst>(I);
+    if (!LD){
+        return !I->mayReadFromMemory();
+    }
+    if (!LD->isSimple()){
+        return false;
+    }
+
+    // nothing in the loop writes the object the load reads
+    if (NoPossibleStoresToAnyAddressInLoop(Summary) || NoPossibleStoresToAddressInLoop(AM, Summary, LD)){
+        return true;
+    }
+
+    // pairwise answers only cover an address that is the same on every
+    // iteration
+    Value *Addr = LD->getPointerOperand();
+    if (!L->isLoopInvariant(Addr)){
+        return false;
+    }
+    if (MemorySSA *MSSA = AM.getMSSA()){
+        return !ClobberedInLoop(MSSA, L, LD);
+    }
+    return !FindAliasingStore(AM, Summary.Stores, LD)
+           && !(Summary.hasCall && MayWrite(Summary.CallEffects, Addr));
+}
+
+static PHINode *GetLCSSAPhi(BasicBlock *Exit, Instruction *I){
+    /* The PHI that carries I into a dedicated exit */
+    for (PHINode &PN: Exit->phis()){
+        if (all_of(PN.incoming_values(), [&](Value *V){ return V == I; })){
+            return &PN;
+        }
+    }
+
+    PHINode *PN = PHINode::Create(I->getType(), 2, I->getName() + ".lcssa", &Exit->front());
+    for (BasicBlock *Pred: predecessors(Exit)){
+        PN->addIncoming(I, Pred);
+    }
+    return PN;
+}
+
+static bool SinkToExits(LICMAnalysis &AM, Loop *L, Instruction *I){
+    /* Replaces the LCSSA PHIs that are the only users of I with a copy of
+     * I in each of their exit blocks */
+    SmallSetVector<PHINode*, 4> Users;
+    for (User *U: I->users()){
+        PHINode *PN = dyn_cast<PHINode>(U);
+        if (!PN || L->contains(PN->getParent())
+            || !all_of(PN->incoming_values(), [&](Value *V){ return V == I; })){
+            return false;
+        }
+        Users.insert(PN);
+    }
+    if (Users.empty()){
+        return false;
+    }
+
+    if (OptimizationRemarkEmitter *ORE = AM.getORE()){
+        ORE->emit([&]{
+            return OptimizationRemark("p3-licm", "Sunk", I)
+                   << "sunk " << ore::NV("Inst", I) << " into " << ore::NV("Exits", (unsigned)Users.size())
+                   << " exits of loop " << ore::NV("Loop", LoopTraceDetail(L));
+        });
+    }
+
+    MemorySSAUpdater *MSSAU = AM.getMSSAUpdater();
+    bool HasAccess = MSSAU && AM.getMSSA()->getMemoryAccess(I);
+    for (PHINode *PN: Users){
+        BasicBlock *Exit = PN->getParent();
+        Instruction *New = I->clone();
+        New->setName(I->getName() + ".le");
+        New->insertBefore(&*Exit->getFirstInsertionPt());
+
+        // operands computed in the loop get to the exit through PHIs too
+        for (Use &Op: New->operands()){
+            Instruction *OI = dyn_cast<Instruction>(Op.get());
+            if (OI && L->contains(OI)){
+                Op.set(GetLCSSAPhi(Exit, OI));
+            }
+        }
+
+        if (HasAccess){
+            MemoryAccess *NewAccess = MSSAU->createMemoryAccessInBB(New, nullptr, Exit, MemorySSA::Beginning);
+            MSSAU->insertUse(cast<MemoryUse>(NewAccess), true);
+        }
+
+        PN->replaceAllUsesWith(New);
+        PN->eraseFromParent();
+    }
+
+    if (HasAccess){
+        MSSAU->removeMemoryAccess(I);
+    }
+    I->eraseFromParent();
+    return true;
+}
+
+static void SinkFromLoop(LICMAnalysis &AM, Loop *L, const LoopMemSummary &Summary){
+    /* Sinks what the loop computes only for the code after it: the blocks
+     * of L itself are visited in postorder and bottom up, so an instruction
+     * is looked at after its users and can follow them into the exits */
+    if (!L->hasDedicatedExits()){
+        return;
+    }
+
+    LoopInfo &LI = AM.getLoopInfo();
+    auto UsedOnlyOutside = [&](Instruction &I){
+        return !I.use_empty() && none_of(I.users(), [&](User *U){
+            return L->contains(cast<Instruction>(U)->getParent());
+        });
+    };
+
+    bool Any = false;
+    for (auto *bb: L->blocks()){
+        if (LI.getLoopFor(bb) != L){
+            continue;
+        }
+        for (auto &i: *bb){
+            Any |= UsedOnlyOutside(i) && CanSinkFrom(AM, L, &i, Summary);
+        }
+    }
+    if (!Any){
+        return;
+    }
+    formLCSSA(*L, AM.getDomTree(), &LI, nullptr);
+
+    LoopBlocksDFS DFS(L);
+    DFS.perform(&LI);
+    for (auto it = DFS.beginPostorder(), e = DFS.endPostorder(); it != e; ++it){
+        BasicBlock *bb = *it;
+        if (LI.getLoopFor(bb) != L){
+            continue;
+        }
+
+        SmallVector<Instruction*, 16> Insts;
+        for (auto &i: *bb){
+            Insts.push_back(&i);
+        }
+        for (Instruction *i: reverse(Insts)){
+            if (!UsedOnlyOutside(*i) || !CanSinkFrom(AM, L, i, Summary)){
+                continue;
+            }
+            if (SinkToExits(AM, L, i)){
+                LICMSunk++;
+                if (LoopRecord *R = AM.getLoopRecord(L)){
+                    R->Sunk++;
+                }
+            }
+        }
+    }
+}
+
+static void SinkLoops(LICMAnalysis &AM){
+    /* Runs after hoisting and promotion, which changed what the loops
+     * store, so their summaries are built again. Inner loops go first,
+     * since what they sink lands in the enclosing loop. */
+    LoopInfo &LI = AM.getLoopInfo();
+    if (LI.empty()){
+        return;
+    }
+    TimeTraceScope SinkScope("LICMSink", AM.getFunction().getName());
+
+    LoopSummaryMap Summaries;
+    for (Loop *L: LI){
+        BuildLoopSummary(AM, L, Summaries);
+    }
+    SmallVector<Loop*, 8> Loops = LI.getLoopsInPreorder();
+    for (Loop *L: reverse(Loops)){
+        SinkFromLoop(AM, L, Summaries[L]);
+    }
+}
+
+static bool UnswitchTrivialBranch(LICMAnalysis &AM, Loop *L, BranchInst *BI){
+    /* An invariant branch that leaves the loop, reached on every iteration
+     * without side effects, is taken on the first iteration or never. The
+     * preheader branches to the exit instead and the loop keeps only the
+     * edge that stays inside. */
+    BasicBlock *BB = BI->getParent();
+    BasicBlock *PH = L->getLoopPreheader();
+    BranchInst *PHTerm = dyn_cast<BranchInst>(PH->getTerminator());
+    bool ExitOnTrue = !L->contains(BI->getSuccessor(0));
+    BasicBlock *Exit = BI->getSuccessor(ExitOnTrue ? 0 : 1);
+    BasicBlock *Continue = BI->getSuccessor(ExitOnTrue ? 1 : 0);
+    if (!PHTerm || !PHTerm->isUnconditional() || !L->contains(Continue) || Exit->isEHPad()){
+        return false;
+    }
+
+    // a loop that this branch is the only way out of is left alone
+    SmallVector<BasicBlock*, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    if (Exiting.size() < 2){
+        return false;
+    }
+
+    // values of the loop used after it get their PHIs in the exits first,
+    // so the exit's PHIs below are all the loop passes it
+    formLCSSARecursively(*L, AM.getDomTree(), &AM.getLoopInfo(), nullptr);
+
+    // the preheader passes the exit what BB passed it, which must not be
+    // computed in the loop
+    for (PHINode &PN: Exit->phis()){
+        if (!L->isLoopInvariant(PN.getIncomingValueForBlock(BB))){
+            return false;
+        }
+    }
+
+    // the other exiting edges get an exit block of their own, so that the
+    // loop keeps dedicated exits
+    SmallVector<BasicBlock*, 4> OtherPreds;
+    for (BasicBlock *Pred: predecessors(Exit)){
+        if (Pred != BB){
+            OtherPreds.push_back(Pred);
+        }
+    }
+    if (!OtherPreds.empty()){
+        SplitBlockPredecessors(Exit, OtherPreds, ".loopexit", &AM.getDomTree(), &AM.getLoopInfo());
+    }
+
+    // the branch goes in a block of its own, which keeps the preheader
+    SplitBlock(PH, PHTerm, &AM.getDomTree(), &AM.getLoopInfo());
+    PHTerm = cast<BranchInst>(PH->getTerminator());
+    BasicBlock *NewPH = L->getLoopPreheader();
+    BranchInst::Create(ExitOnTrue ? Exit : NewPH, ExitOnTrue ? NewPH : Exit, BI->getCondition(), PHTerm);
+    PHTerm->eraseFromParent();
+    Exit->replacePhiUsesWith(BB, PH);
+    BranchInst::Create(Continue, BI);
+    BI->eraseFromParent();
+    AM.getDomTree().recalculate(AM.getFunction());
+    return true;
+}
+
+static unsigned UnswitchTrivialBranches(LICMAnalysis &AM, Loop *L){
+    /* Walks the blocks that run first on every iteration, from the header
+     * along unconditional branches, as long as nothing in them has side
+     * effects. Values used after the loop only matter on the edge that is
+     * unswitched, which UnswitchTrivialBranch checks. */
+    unsigned Count = 0;
+    BasicBlock *BB = L->getHeader();
+    while (true){
+        for (auto &i: *BB){
+            if (i.mayHaveSideEffects()){
+                return Count;
+            }
+        }
+
+        BranchInst *BI = dyn_cast<BranchInst>(BB->getTerminator());
+        if (!BI){
+            return Count;
+        }
+        if (BI->isConditional()){
+            Value *Cond = BI->getCondition();
+            if (isa<Constant>(Cond) || !L->isLoopInvariant(Cond)
+                || L->contains(BI->getSuccessor(0)) == L->contains(BI->getSuccessor(1))){
+                return Count;
+            }
+            if (!UnswitchTrivialBranch(AM, L, BI)){
+                return Count;
+            }
+            Count++;
+            LICMUnswitchedTrivial++;
+            if (OptimizationRemarkEmitter *ORE = AM.getORE()){
+                ORE->emit([&]{
+                    return OptimizationRemark("p3-licm", "UnswitchedTrivial", L->getStartLoc(), L->getHeader())
+                           << "moved invariant exit branch on " << ore::NV("Condition", Cond)
+                           << " out of loop " << ore::NV("Loop", LoopTraceDetail(L));
+                });
+            }
+        }
+
+        BasicBlock *Next = BB->getTerminator()->getSuccessor(0);
+        if (Next == L->getHeader() || !L->contains(Next) || Next->getSinglePredecessor() != BB){
+            return Count;
+        }
+        BB = Next;
+    }
+}
+
+static BranchInst *FindUnswitchCandidate(Loop *L){
+    /* A branch inside the loop on a condition that hoisting left invariant */
+    for (auto *bb: L->blocks()){
+        BranchInst *BI = dyn_cast<BranchInst>(bb->getTerminator());
+        if (BI && BI->isConditional() && !isa<Constant>(BI->getCondition())
+            && L->isLoopInvariant(BI->getCondition())
+            && BI->getSuccessor(0) != BI->getSuccessor(1)
+            && L->contains(BI->getSuccessor(0)) && L->contains(BI->getSuccessor(1))){
+            return BI;
+        }
+    }
+    return nullptr;
+}
+
+static void UnswitchLoop(LICMAnalysis &AM, Loop *L, BranchInst *BI, SmallVectorImpl<BasicBlock*> &Fold){
+    /* Non-trivial unswitching: the loop is cloned behind a branch on the
+     * invariant condition in its preheader. The original runs when the
+     * condition is true and the clone when it is false, each with the
+     * branch on a constant that is folded once all loops are done. */
+    Function &F = AM.getFunction();
+    DominatorTree &DT = AM.getDomTree();
+    LoopInfo &LI = AM.getLoopInfo();
+    formLCSSARecursively(*L, DT, &LI, nullptr);
+
+    BasicBlock *CheckBB = L->getLoopPreheader();
+    BasicBlock *PH = SplitBlock(CheckBB, CheckBB->getTerminator(), &DT, &LI, nullptr,
+                                L->getHeader()->getName() + ".us.ph");
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock*, 8> Blocks;
+    Loop *Clone = cloneLoopWithPreheader(PH, CheckBB, L, VMap, ".us", &LI, &DT, Blocks);
+    remapInstructionsInBlocks(Blocks, VMap);
+
+    // values used after the loop now come from either copy
+    SmallVector<BasicBlock*, 4> Exits;
+    L->getUniqueExitBlocks(Exits);
+    for (BasicBlock *Exit: Exits){
+        for (PHINode &PN: Exit->phis()){
+            for (unsigned i = 0, e = PN.getNumIncomingValues(); i != e; i++){
+                BasicBlock *From = PN.getIncomingBlock(i);
+                if (L->contains(From)){
+                    Value *V = PN.getIncomingValue(i);
+                    Value *ClonedV = VMap.lookup(V);
+                    PN.addIncoming(ClonedV ? ClonedV : V, cast<BasicBlock>(VMap[From]));
+                }
+            }
+        }
+    }
+
+    // the branch may not have run in the loop, so the check must not
+    // branch on poison
+    Value *Cond = BI->getCondition();
+    Instruction *CheckTerm = CheckBB->getTerminator();
+    if (!isGuaranteedNotToBeUndefOrPoison(Cond, nullptr, CheckTerm, &DT)){
+        Cond = new FreezeInst(Cond, Cond->getName() + ".fr", CheckTerm);
+    }
+    BranchInst::Create(PH, Clone->getLoopPreheader(), Cond, CheckTerm);
+    CheckTerm->eraseFromParent();
+
+    BranchInst *CloneBI = cast<BranchInst>(VMap[BI]);
+    BI->setCondition(ConstantInt::getTrue(F.getContext()));
+    CloneBI->setCondition(ConstantInt::getFalse(F.getContext()));
+    Fold.push_back(BI->getParent());
+    Fold.push_back(CloneBI->getParent());
+
+    DT.recalculate(F);
+}
+
+static void UnswitchLoops(LICMAnalysis &AM, unsigned MaxSize){
+    /* Loop unswitching, after hoisting has made more branch conditions
+     * invariant. Branches to an exit are always moved to the preheader;
+     * other invariant branches clone loops of at most MaxSize
+     * instructions, once per loop. */
+    LoopInfo &LI = AM.getLoopInfo();
+    if (LI.empty()){
+        return;
+    }
+    TimeTraceScope UnswitchScope("LICMUnswitch", AM.getFunction().getName());
+
+    SmallVector<Loop*, 8> Loops = LI.getLoopsInPreorder();
+    bool Changed = false;
+    for (Loop *L: Loops){
+        if (!L->getLoopPreheader()){
+            continue;
+        }
+        unsigned Count = UnswitchTrivialBranches(AM, L);
+        if (Count){
+            Changed = true;
+            if (LoopRecord *R = AM.getLoopRecord(L)){
+                R->UnswitchedTrivial += Count;
+            }
+        }
+    }
+
+    // outer loops first, so that a branch invariant in a whole nest is
+    // unswitched around all of it
+    SmallVector<BasicBlock*, 8> Fold;
+    for (Loop *L: Loops){
+        unsigned Size = 0;
+        for (auto *bb: L->blocks()){
+            Size += bb->size();
+        }
+        if (!L->getLoopPreheader() || !L->hasDedicatedExits() || !L->isSafeToClone()
+            || Size > MaxSize){
+            continue;
+        }
+
+        bool Convergent = false;
+        for (auto *bb: L->blocks()){
+            for (auto &i: *bb){
+                if (CallBase *CB = dyn_cast<CallBase>(&i)){
+                    Convergent |= CB->isConvergent();
+                }
+            }
+        }
+        BranchInst *BI = Convergent ? nullptr : FindUnswitchCandidate(L);
+        if (!BI){
+            continue;
+        }
+
+        Value *Cond = BI->getCondition();
+        std::string Detail = LoopTraceDetail(L);
+        if (OptimizationRemarkEmitter *ORE = AM.getORE()){
+            ORE->emit([&]{
+                return OptimizationRemark("p3-licm", "Unswitched", L->getStartLoc(), L->getHeader())
+                       << "unswitched loop " << ore::NV("Loop", Detail)
+                       << " on " << ore::NV("Condition", Cond);
+            });
+        }
+        UnswitchLoop(AM, L, BI, Fold);
+        Changed = true;
+        LICMUnswitched++;
+        if (LoopRecord *R = AM.getLoopRecord(L)){
+            R->Unswitched++;
+        }
+    }
+
+    if (!Changed){
+        return;
+    }
+    for (BasicBlock *bb: Fold){
+        ConstantFoldTerminator(bb);
+    }
+    removeUnreachableBlocks(AM.getFunction());
+    AM.loopsUnswitched();
+}
+
+static bool IsCheapToRecompute(const Instruction *I){
+    /* Address arithmetic, casts and adds of a constant, which cost a loop
+     * about as little as the register that would hold them */
+    if (isa<GetElementPtrInst>(I) || isa<CastInst>(I)){
+        return true;
+    }
+    if (I->getOpcode() == Instruction::Add || I->getOpcode() == Instruction::Sub){
+        return isa<Constant>(I->getOperand(0)) || isa<Constant>(I->getOperand(1));
+    }
+    return false;
+}
+
+static Loop *FitHoistTarget(LICMAnalysis &AM, Loop *Inner, Loop *Target, Instruction *I){
+    /* The cost model: I stays live through every loop from Inner out to
+     * Target once hoisted, so a cheap I only leaves the loops that have
+     * registers to spare for it. Returns the outermost of those, if any. */
+    if (!IsCheapToRecompute(I)){
+        return Target;
+    }
+    Loop *Fit = nullptr;
+    for (Loop *L = Inner; ; L = L->getParentLoop()){
+        RegPressure *P = AM.getPressure(L);
+        if (!P){
+            return Target;
+        }
+        if (!P->fits(I)){
+            break;
+        }
+        Fit = L;
+        if (L == Target){
+            return Fit;
+        }
+    }
+    if (!Fit && AM.defer(I)){
+        LICMHoistDeferred++;
+    }
+    return Fit;
+}
+
+static void NoteHoisted(LICMAnalysis &AM, Loop *Inner, Loop *Target, Instruction *I){
+    /* Updates the register estimates of the loops I was hoisted out of */
+    for (Loop *L = Inner; ; L = L->getParentLoop()){
+        if (RegPressure *P = AM.getPressure(L)){
+            P->hoisted(I);
+        }
+        if (L == Target){
+            break;
+        }
+    }
+}
+
+static void UpdateLoopStats(Loop *L){
+    bool hasLoad, hasStore;
+
+    for (BasicBlock *bb: L->blocks()){
+        hasLoad  = hasStore = false;
+        for (BasicBlock::iterator i = bb->begin(), e = bb->end(); i != e; ++i){
+            if (isa<LoadInst>(&*i)){
+                hasLoad = true;
+            }
+            if (isa<StoreInst>(&*i)){
+                hasStore = true;
+            }
+        }
+
+        updateStats(hasLoad, hasStore);
+    }
+}
+
+static bool OptimizeLoop(LICMAnalysis &AM, Loop *L, LoopSummaryMap &Summaries){
+    /* Returns whether promotion erased accesses of L, which leaves the
+     * summaries of the enclosing loops pointing at deleted instructions */
+    TimeTraceScope LoopScope("LICMLoop", [&]{ return LoopTraceDetail(L); });
+    NumLoops++;
+
+    BasicBlock *PH = L->getLoopPreheader();
+    if (PH==NULL){
+        LICMNoPreheader++;
+        RecordRejections(AM, L, nullptr);
+        return false;
+    }
+
+    //recursive call to optimize all the subloops
+    bool promoted = false;
+    for (auto subloop: L->getSubLoops()){
+        promoted |= OptimizeLoop(AM, subloop, Summaries);
+    }
+    if (promoted){
+        SummarizeLoop(AM, L, Summaries);
+    }
+
+    const LoopMemSummary &Summary = Summaries[L];
+    bool changed;
+
+    UpdateLoopStats(L);
+    // estimate the registers before anything leaves L
+    AM.getPressure(L);
+
+    //work with the worklist until nothing else becomes invariant
+    LoopWorklist worklist(L, AM.getLoopInfo());
+    while (Instruction* i = worklist.pop()){
+        changed = false;
+
+        // already moved out of this loop
+        if (!L->contains(i)){
+            continue;
+        }
+
+        if (CallInst *CI = dyn_cast<CallInst>(i)){
+            if (CanHoistCall(AM, L, CI, Summary)){
+                hoistInstructionToPreheader(CI, PH, AM);
+                NoteHoisted(AM, L, L, CI);
+                LICMCallHoist++;
+                RecordHoist(AM, L, CI);
+                worklist.pushUsers(CI);
+            }
+        }
+
+        else if (NotALoadOrStore(i)){
+            if (AreAllOperandsLoopInvaraint(L, i) && FitHoistTarget(AM, L, L, i)){
+                L->makeLoopInvariant(i, changed);
+                if (changed) {
+                    NoteHoisted(AM, L, L, i);
+                    LICMBasic++;
+                    RecordHoist(AM, L, i);
+                    worklist.pushUsers(i);
+                }
+            }
+        }
+
+        else {
+            if (isa<LoadInst>(i)){
+                Value* addr = i->getOperand(0); // address for Load instruction
+                if (CanMoveOutofLoop(AM, L, i, addr, Summary)){
+
+                    hoistInstructionToPreheader(i, PH, AM);
+                    NoteHoisted(AM, L, L, i);
+                    LICMLoadHoist++;
+                    if (Summary.hasCall) {LICMLoadHoistAcrossCall++;}
+                    RecordHoist(AM, L, i);
+                    worklist.pushUsers(i);
+                }
+            }
+        }
+    }
+
+    if (PromoteLoopMemory(AM, L, PH, Summary)){
+        // promotion may also have erased accesses in the subloops
+        BuildLoopSummary(AM, L, Summaries);
+        promoted = true;
+    }
+    RecordRejections(AM, L, &Summaries[L]);
+
+    if (Summaries[L].hasCall || Summaries[L].hasPureCall) {NumLoopsWithCall++;}
+    return promoted;
+}
+
+static bool CanHoistFrom(LICMAnalysis &AM, Loop *L, Instruction *I, const LoopMemSummary &Summary){
+    /* Checks whether I may move to the preheader of L */
+    if (CallInst *CI = dyn_cast<CallInst>(I)){
+        return CanHoistCall(AM, L, CI, Summary);
+    }
+    if (NotALoadOrStore(I)){
+        return AreAllOperandsLoopInvaraint(L, I) && isSafeToSpeculativelyExecute(I)
+            && !I->mayReadFromMemory() && !I->isEHPad() && !isa<PHINode>(I);
+    }
+    if (isa<LoadInst>(I)){
+        return CanMoveOutofLoop(AM, L, I, I->getOperand(0), Summary);
+    }
+    return false;
+}
+
+static void OptimizeLoopNest(LICMAnalysis &AM, Loop *Top, LoopSummaryMap &Summaries){
+    /* Hoists every instruction of the nest in a single pass. Each one is
+     * checked against its innermost loop and then each enclosing loop in
+     * turn, and moved once to the preheader of the outermost loop it can
+     * leave, instead of once per level. */
+    TimeTraceScope NestScope("LICMLoopNest", [&]{ return LoopTraceDetail(Top); });
+    SmallVector<Loop*, 8> Nest = Top->getLoopsInPreorder();
+    for (Loop *L: Nest){
+        NumLoops++;
+        if (!L->getLoopPreheader()){
+            LICMNoPreheader++;
+        }
+        UpdateLoopStats(L);
+        AM.getPressure(L);
+    }
+
+    LoopInfo &LI = AM.getLoopInfo();
+    LoopWorklist worklist(Top, LI);
+    while (Instruction* i = worklist.pop()){
+        // already moved out of the nest
+        if (!Top->contains(i)){
+            continue;
+        }
+
+        Loop *Inner = LI.getLoopFor(i->getParent());
+        Loop *Target = nullptr;
+        for (Loop *L = Inner; L; L = L->getParentLoop()){
+            if (!L->getLoopPreheader() || !CanHoistFrom(AM, L, i, Summaries[L])){
+                break;
+            }
+            Target = L;
+        }
+        if (Target){
+            Target = FitHoistTarget(AM, Inner, Target, i);
+        }
+        if (!Target){
+            continue;
+        }
+
+        if (isa<CallInst>(i)){
+            hoistInstructionToPreheader(i, Target->getLoopPreheader(), AM);
+            LICMCallHoist++;
+        }
+        else if (isa<LoadInst>(i)){
+            hoistInstructionToPreheader(i, Target->getLoopPreheader(), AM);
+            LICMLoadHoist++;
+            if (Summaries[Target].hasCall) {LICMLoadHoistAcrossCall++;}
+        }
+        else {
+            bool changed = false;
+            Target->makeLoopInvariant(i, changed);
+            if (!changed){
+                continue;
+            }
+            LICMBasic++;
+        }
+        NoteHoisted(AM, Inner, Target, i);
+        RecordHoist(AM, Target, i);
+        worklist.pushUsers(i);
+    }
+
+    // promotion works level by level, innermost loops first. Each loop comes
+    // after all of its subloops, so a loop whose subloops promoted anything
+    // is summarized again from theirs before it is looked at.
+    SmallPtrSet<Loop*, 8> Stale;
+    for (Loop *L: reverse(Nest)){
+        if (Stale.count(L)){
+            SummarizeLoop(AM, L, Summaries);
+        }
+        if (BasicBlock *PH = L->getLoopPreheader()){
+            if (PromoteLoopMemory(AM, L, PH, Summaries[L])){
+                BuildLoopSummary(AM, L, Summaries);
+                for (Loop *P = L->getParentLoop(); P; P = P->getParentLoop()){
+                    Stale.insert(P);
+                }
+            }
+            RecordRejections(AM, L, &Summaries[L]);
+        }
+        else {
+            RecordRejections(AM, L, nullptr);
+        }
+        if (Summaries[L].hasCall || Summaries[L].hasPureCall) {NumLoopsWithCall++;}
+    }
+}
+
+static std::unique_ptr<GlobalsAAResult> AnalyzeGlobals(Module *M, const TargetLibraryInfo &TLI,
+                                                       std::unique_ptr<CallGraph> &CG){
+    /* GlobalsAA is a module analysis, compute it once for all functions */
+    CG.reset(new CallGraph(*M));
+    return std::unique_ptr<GlobalsAAResult>(new GlobalsAAResult(GlobalsAAResult::analyzeModule(
+        *M, [&TLI](Function &) -> const TargetLibraryInfo & { return TLI; }, *CG)));
+}
+
+static void StartFunctionRecord(LICMAnalysis &AM, const TargetLibraryInfo &TLI, FunctionRecord &FR){
+    /* Fills in what is known about the loops before anything is hoisted. The
+     * trip count class comes from a ScalarEvolution that is dropped again,
+     * since hoisting does not keep it up to date. */
+    Function &F = AM.getFunction();
+    FR.Name = F.getName().str();
+    FR.Instructions = F.getInstructionCount();
+
+    LoopInfo &LI = AM.getLoopInfo();
+    if (LI.empty()){
+        return;
+    }
+
+    // ScalarEvolution wants a mutable TargetLibraryInfo
+    TargetLibraryInfo SETLI(TLI);
+    AssumptionCache AC(F);
+    ScalarEvolution SE(F, SETLI, AC, AM.getDomTree(), LI);
+    for (Loop *L: LI.getLoopsInPreorder()){
+        LoopRecord R;
+        raw_string_ostream OS(R.Header);
+        L->getHeader()->printAsOperand(OS, false);
+        OS.flush();
+        R.Depth = L->getLoopDepth();
+        R.Versioned = AM.isVersioned(L);
+        for (BasicBlock *bb: L->blocks()){
+            R.Instructions += bb->size();
+        }
+
+        if (SE.getSmallConstantTripCount(L)){
+            R.TripCount = "constant";
+        }
+        else if (SE.getSmallConstantMaxTripCount(L)){
+            R.TripCount = "bounded";
+        }
+        else if (!isa<SCEVCouldNotCompute>(SE.getBackedgeTakenCount(L))){
+            R.TripCount = "symbolic";
+        }
+
+        FR.Index[L] = FR.Loops.size();
+        FR.Loops.push_back(std::move(R));
+    }
+}
+
+static void RunLICMOnFunction(Function &F, const TargetLibraryInfo &TLI, GlobalsAAResult *GAR,
+                              const ModRefSummaries *ModRef, TargetMachine *TM, const P3Options &Opts){
+    // for empty function, stop considering
+    if (F.begin() == F.end()){
+        return;
+    }
+
+    TimeTraceScope FunctionScope("LICMFunction", F.getName());
+
+    // dominance, loop info and (optionally) MemorySSA for Function, F
+    LICMAnalysis AM(F, TLI, GAR, ModRef);
+    AM.setTypedAA(Opts.TypedAA);
+    AM.setCostModel(TM, Opts.RegBudget);
+    AM.simplifyLoops();
+    if (Opts.VersionLoops){
+        VersionLoopsWithAliasChecks(AM, Opts.VersionMaxSize);
+    }
+
+    FunctionRecord FR;
+    if (Opts.StatsJSON){
+        StartFunctionRecord(AM, TLI, FR);
+        AM.setReport(&FR);
+    }
+
+    LoopSummaryMap Summaries;
+    for(auto li: AM.getLoopInfo()) {
+        BuildLoopSummary(AM, li, Summaries);
+        if (Opts.HoistOutermost){
+            OptimizeLoopNest(AM, li, Summaries);
+        }
+        else {
+            OptimizeLoop(AM, li, Summaries);
+        }
+    }
+    SinkLoops(AM);
+    UnswitchLoops(AM, Opts.UnswitchMaxSize);
+
+    if (Opts.StatsJSON){
+        CurrentStats->addFunctionRecord(std::move(FR));
+    }
+}
+
+static std::unique_ptr<TargetMachine> CostModelTarget(const Module *M, const P3Options &Opts){
+    /* The target whose registers the hoisting cost model counts, unless
+     * -licm-reg-budget leaves the model off or the target is not built in */
+    if (Opts.RegBudget < 0){
+        return nullptr;
+    }
+    std::string TripleName = M->getTargetTriple();
+    if (TripleName.empty()){
+        TripleName = sys::getDefaultTargetTriple();
+    }
+    std::string Error;
+    const Target *T = TargetRegistry::lookupTarget(TripleName, Error);
+    if (!T){
+        return nullptr;
+    }
+    return std::unique_ptr<TargetMachine>(T->createTargetMachine(TripleName, "", "", TargetOptions(), None));
+}
+
+static void RunLICMBasic(Module *M, const ModRefSummaries *ModRef, const P3Options &Opts){
+    TargetLibraryInfoImpl TLII(Triple(M->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    std::unique_ptr<TargetMachine> TM = CostModelTarget(M, Opts);
+
+    std::unique_ptr<CallGraph> CG;
+    std::unique_ptr<GlobalsAAResult> GAR;
+    if (Opts.LICMMemSSA){
+        GAR = AnalyzeGlobals(M, TLI, CG);
+    }
+
+    for (auto &F: *M){
+        RunLICMOnFunction(F, TLI, GAR.get(), ModRef, TM.get(), Opts);
+    }
+}
+
+static bool IsErrnoOnlyMathFunc(LibFunc LF){
+    /* Math functions whose only side effect is setting errno */
+    switch (LF){
+    case LibFunc_sqrt: case LibFunc_sqrtf:
+    case LibFunc_sin: case LibFunc_sinf:
+    case LibFunc_cos: case LibFunc_cosf:
+    case LibFunc_tan: case LibFunc_tanf:
+    case LibFunc_asin: case LibFunc_acos:
+    case LibFunc_atan: case LibFunc_atanf:
+    case LibFunc_atan2: case LibFunc_atan2f:
+    case LibFunc_exp: case LibFunc_expf:
+    case LibFunc_log: case LibFunc_logf:
+    case LibFunc_log10: case LibFunc_pow: case LibFunc_powf:
+    case LibFunc_fabs: case LibFunc_fabsf:
+    case LibFunc_floor: case LibFunc_ceil: case LibFunc_fmod:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void InferFunctionAttributes(Module *M, const P3Options &Opts){
+    /* Attributes of library declarations come from TargetLibraryInfo, those
+     * of defined functions are deduced bottom-up over the call graph so that
+     * calls can be hoisted and stop blocking loads */
+    Triple TT(M->getTargetTriple());
+    {
+        legacy::PassManager Passes;
+        Passes.add(new TargetLibraryInfoWrapperPass(TT));
+        Passes.add(createInferFunctionAttrsLegacyPass());
+        Passes.run(*M);
+    }
+
+    if (Opts.NoMathErrno){
+        TargetLibraryInfoImpl TLII(TT);
+        TargetLibraryInfo TLI(TLII);
+        for (auto &F: *M){
+            LibFunc LF;
+            if (F.isDeclaration() && TLI.getLibFunc(F, LF) && IsErrnoOnlyMathFunc(LF)){
+                F.removeFnAttr(Attribute::WriteOnly);
+                F.setDoesNotAccessMemory();
+            }
+        }
+    }
+
+    legacy::PassManager Passes;
+    Passes.add(new TargetLibraryInfoWrapperPass(TT));
+    Passes.add(createPostOrderFunctionAttrsLegacyPass());
+    Passes.run(*M);
+}
+
+static bool CanRunPartitioned(Module *M, const P3Options &Opts){
+    /* A partition only sees the functions assigned to it, so anything that
+     * needs the whole module keeps the serial path */
+
+    // GlobalsAA is a module analysis
+    if (Opts.LICMMemSSA){
+        return false;
+    }
+
+    // remarks are streamed by the context of the module
+    if (!Opts.RemarksFile.empty()){
+        return false;
+    }
+
+    // distinct debug info nodes would be duplicated by linking
+    if (M->getNamedMetadata("llvm.dbg.cu")){
+        return false;
+    }
+
+    // aliases are not split into partitions
+    if (!M->alias_empty() || !M->ifunc_empty()){
+        return false;
+    }
+
+    // linking resolves globals by name, so an unnamed one could not be
+    // found again
+    for (auto &GV: M->global_values()){
+        if (!GV.hasName()){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void RunLICMPartitioned(Module *M, const ModRefSummaries *ModRef, const P3Options &Opts){
+    /* Splits the functions of the module into partitions, optimizes each
+     * partition in its own LLVMContext on a thread pool and links the
+     * results back in the original function order */
+    std::vector<Function*> Defined;
+    for (auto &F: *M){
+        if (!F.isDeclaration()){
+            Defined.push_back(&F);
+        }
+    }
+
+    unsigned NumPartitions = std::min<unsigned>(Opts.Jobs, Defined.size());
+    if (NumPartitions < 2){
+        RunLICMBasic(M, ModRef, Opts);
+        return;
+    }
+
+    // largest functions first, each to the least loaded partition
+    std::vector<Function*> BySize(Defined);
+    std::stable_sort(BySize.begin(), BySize.end(), [](Function *A, Function *B){
+        return A->getInstructionCount() > B->getInstructionCount();
+    });
+
+    DenseMap<const GlobalValue*, unsigned> PartitionOf;
+    std::vector<unsigned> Load(NumPartitions, 0);
+    for (Function *F: BySize){
+        unsigned p = std::min_element(Load.begin(), Load.end()) - Load.begin();
+        PartitionOf[F] = p;
+        Load[p] += F->getInstructionCount();
+    }
+
+    std::vector<SmallVector<char, 0>> Buffers(NumPartitions);
+    for (unsigned p = 0; p < NumPartitions; p++){
+        ValueToValueMapTy VMap;
+        std::unique_ptr<Module> Part = CloneModule(*M, VMap, [&](const GlobalValue *GV){
+            auto It = PartitionOf.find(GV);
+            return It != PartitionOf.end() && It->second == p;
+        });
+        raw_svector_ostream OS(Buffers[p]);
+        WriteBitcodeToFile(*Part, OS);
+    }
+
+    ThreadPool Pool(hardware_concurrency(NumPartitions));
+    for (unsigned p = 0; p < NumPartitions; p++){
+        Pool.async([&Buffers, &Opts, ModRef, p, Stats = CurrentStats]{
+            // partitions count into the statistics of the whole module
+            CurrentStats = Stats;
+            TraceThread Trace(Opts);
+
+            LLVMContext PartContext;
+            MemoryBufferRef Buffer(StringRef(Buffers[p].data(), Buffers[p].size()), "partition");
+            Expected<std::unique_ptr<Module>> Part = parseBitcodeFile(Buffer, PartContext);
+            if (!Part){
+                report_fatal_error(Part.takeError());
+            }
+
+            RunLICMBasic(Part->get(), ModRef, Opts);
+
+            Buffers[p].clear();
+            raw_svector_ostream OS(Buffers[p]);
+            WriteBitcodeToFile(**Part, OS);
+        });
+    }
+    Pool.wait();
+
+    // Local symbols do not take part in symbol resolution, so they are made
+    // external while linking and restored afterwards
+    struct SavedGlobal {
+        std::string Name;
+        GlobalValue::LinkageTypes Linkage;
+        bool DSOLocal;
+    };
+    std::vector<SavedGlobal> Saved;
+    std::vector<std::string> FunctionOrder;
+    for (auto &GV: M->global_values()){
+        Saved.push_back({GV.getName().str(), GV.getLinkage(), GV.isDSOLocal()});
+        if (GV.hasLocalLinkage()){
+            GV.setLinkage(GlobalValue::ExternalLinkage);
+        }
+    }
+    for (auto &F: *M){
+        FunctionOrder.push_back(F.getName().str());
+    }
+
+    for (Function *F: Defined){
+        F->deleteBody();
+    }
+
+    // partitions are read lazily and the linker materializes their bodies.
+    // Reading them eagerly would also verify them for the debug info
+    // upgrade, which registers metadata kinds in the module's context that
+    // the serial path never sees, and the writer emits every kind it knows.
+    Linker L(*M);
+    for (unsigned p = 0; p < NumPartitions; p++){
+        MemoryBufferRef Buffer(StringRef(Buffers[p].data(), Buffers[p].size()), "partition");
+        Expected<std::unique_ptr<Module>> Part = getLazyBitcodeModule(Buffer, M->getContext());
+        if (!Part){
+            report_fatal_error(Part.takeError());
+        }
+
+        for (auto &GV: (*Part)->global_values()){
+            if (GV.hasLocalLinkage()){
+                GV.setLinkage(GlobalValue::ExternalLinkage);
+            }
+        }
+        // module level metadata is already in M
+        if (Error E = (*Part)->materializeMetadata()){
+            report_fatal_error(std::move(E));
+        }
+        while (!(*Part)->named_metadata_empty()){
+            (*Part)->eraseNamedMetadata(&*(*Part)->named_metadata_begin());
+        }
+
+        if (L.linkInModule(std::move(*Part))){
+            report_fatal_error("p3: could not link partition back into the module");
+        }
+    }
+
+    // functions a partition added, such as intrinsic declarations, go last
+    // in the order the serial path creates them, by their first user
+    DenseMap<const Function*, unsigned> Position;
+    for (unsigned i = 0; i < FunctionOrder.size(); i++){
+        Position[M->getFunction(FunctionOrder[i])] = i;
+    }
+    std::vector<std::pair<unsigned, Function*>> Added;
+    for (auto &F: *M){
+        if (Position.count(&F)){
+            continue;
+        }
+        unsigned First = FunctionOrder.size();
+        for (User *U: F.users()){
+            if (Instruction *I = dyn_cast<Instruction>(U)){
+                First = std::min(First, Position.lookup(I->getFunction()));
+            }
+        }
+        Added.push_back({First, &F});
+    }
+    std::stable_sort(Added.begin(), Added.end(), [](const std::pair<unsigned, Function*> &A,
+                                                    const std::pair<unsigned, Function*> &B){
+        return A.first < B.first;
+    });
+
+    for (auto &Name: FunctionOrder){
+        Function *F = M->getFunction(Name);
+        F->removeFromParent();
+        M->getFunctionList().push_back(F);
+    }
+    for (auto &A: Added){
+        A.second->removeFromParent();
+        M->getFunctionList().push_back(A.second);
+    }
+    for (auto &G: Saved){
+        GlobalValue *GV = M->getNamedValue(G.Name);
+        GV->setLinkage(G.Linkage);
+        GV->setDSOLocal(G.DSOLocal);
+    }
+}
+
+static void CanonicalizeSymbolTables(Module *M){
+    /* The bitcode writer emits local names in symbol table order, which
+     * depends on the history of the table. Rebuilding every function's table
+     * from its current body makes the output independent of how the body was
+     * produced, so every -j run writes the same bitcode for any number of
+     * partitions. */
+    std::vector<Function*> Defined;
+    for (auto &F: *M){
+        if (!F.isDeclaration()){
+            Defined.push_back(&F);
+        }
+    }
+
+    for (Function *F: Defined){
+        Function *NF = Function::Create(F->getFunctionType(), F->getLinkage(), F->getAddressSpace(), "");
+        M->getFunctionList().insert(F->getIterator(), NF);
+        NF->copyAttributesFrom(F);
+        NF->setComdat(F->getComdat());
+        NF->copyMetadata(F, 0);
+        NF->stealArgumentListFrom(*F);
+        NF->getBasicBlockList().splice(NF->end(), F->getBasicBlockList());
+        NF->takeName(F);
+        F->replaceAllUsesWith(NF);
+        F->eraseFromParent();
+    }
+}
+
+static void LoopInvariantCodeMotion(Module *M, const P3Options &Opts) {
+    InferFunctionAttributes(M, Opts);
+
+    // summarized once for the whole module, partitions only see part of it
+    ModRefSummaries ModRef(*M);
+
+    if (Opts.Jobs > 1 && CanRunPartitioned(M, Opts)){
+        RunLICMPartitioned(M, &ModRef, Opts);
+    } else {
+        RunLICMBasic(M, &ModRef, Opts);
+    }
+
+    // any number of partitions gives the same bytes, even when the module
+    // could not be split; the serial output is left as it is
+    if (Opts.Jobs > 1){
+        CanonicalizeSymbolTables(M);
+    }
 }
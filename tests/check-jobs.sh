@@ -0,0 +1,32 @@
+#!/bin/sh
+# check-jobs.sh <p3> <llvm-dis> <name> <input.ll> <N>... [-- p3 flags...]
+#
+# Optimizes the input serially and with -j N for every N. Every run must
+# write the same module and statistics as the serial one, and the runs
+# with more than one job, whose local symbol tables are canonicalized, the
+# same bitcode byte for byte.
+set -e
+P3=$1 DIS=$2 NAME=$3 INPUT=$4
+shift 4
+
+JOBS=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    JOBS="$JOBS $1"
+    shift
+done
+[ $# -gt 0 ] && shift
+
+# the module ID names the output file
+"$P3" "$INPUT" "$NAME.bc" "$@"
+"$DIS" "$NAME.bc" -o - | sed 1d > "$NAME.ll"
+FIRST=
+for N in $JOBS; do
+    "$P3" "$INPUT" "$NAME.j$N.bc" -j "$N" "$@"
+    "$DIS" "$NAME.j$N.bc" -o - | sed 1d > "$NAME.j$N.ll"
+    diff -u "$NAME.ll" "$NAME.j$N.ll"
+    cmp "$NAME.bc.stats" "$NAME.j$N.bc.stats"
+    if [ "$N" -gt 1 ]; then
+        [ -z "$FIRST" ] && FIRST=$N
+        cmp "$NAME.j$FIRST.bc" "$NAME.j$N.bc"
+    fi
+done
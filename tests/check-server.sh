@@ -0,0 +1,38 @@
+#!/bin/sh
+# check-server.sh <p3> <name> <input.ll> [p3 flags...]
+#
+# Optimizes the input in process and through a compile server that was
+# started with flags of its own, and fails unless both write the same
+# bitcode, statistics, per-loop statistics when asked for, and remarks.
+# Then checks that a client without a server still writes its time trace.
+set -e
+P3=$1 NAME=$2 INPUT=$3
+shift 3
+SOCKET=$NAME.sock
+
+rm -f "$SOCKET" "$NAME.local.bc.stats.json" "$NAME.bc.stats.json"
+"$P3" --serve "$SOCKET" -mem2reg -licm-hoist-outermost -licm-reg-budget=1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+n=0
+while [ ! -S "$SOCKET" ]; do
+    n=$((n + 1))
+    [ $n -lt 50 ] || { echo "server did not start"; exit 1; }
+    sleep 0.1
+done
+
+"$P3" "$INPUT" "$NAME.local.bc" -pass-remarks-output="$NAME.local.opt.yaml" "$@"
+"$P3" --connect "$SOCKET" "$INPUT" "$NAME.bc" -pass-remarks-output="$NAME.opt.yaml" "$@"
+cmp "$NAME.local.bc" "$NAME.bc"
+cmp "$NAME.local.bc.stats" "$NAME.bc.stats"
+cmp "$NAME.local.opt.yaml" "$NAME.opt.yaml"
+if [ -f "$NAME.local.bc.stats.json" ]; then
+    cmp "$NAME.local.bc.stats.json" "$NAME.bc.stats.json"
+fi
+
+kill $SERVER
+wait $SERVER 2>/dev/null || true
+trap - EXIT
+rm -f "$SOCKET" "$NAME.json"
+"$P3" --connect "$SOCKET" "$INPUT" "$NAME.bc" -time-trace="$NAME.json" "$@"
+grep -q traceEvents "$NAME.json"
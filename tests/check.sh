@@ -0,0 +1,15 @@
+#!/bin/sh
+# check.sh <p3> <llvm-dis> <FileCheck> <name> <input.ll> [p3 flags...]
+#
+# Optimizes the input into <name>.bc, compares <name>.bc.stats with the
+# <name>.stats file next to the input and checks the disassembled output
+# against the CHECK lines of the input.
+set -e
+P3=$1 DIS=$2 FILECHECK=$3 NAME=$4 INPUT=$5
+shift 5
+
+"$P3" "$INPUT" "$NAME.bc" "$@"
+diff -u "$(dirname "$INPUT")/$NAME.stats" "$NAME.bc.stats"
+if grep -q "CHECK" "$INPUT"; then
+    "$DIS" "$NAME.bc" -o - | "$FILECHECK" "$INPUT"
+fi
@@ -0,0 +1,65 @@
+; The summary of a body the linker may replace says nothing about the body
+; that runs, so a call to @weak_touch may write @G. The call to @touch,
+; whose body is final, cannot, and the load is hoisted.
+
+; CHECK-LABEL: define i32 @sum_weak(
+; CHECK: loop:
+; CHECK-NEXT: %i = phi
+; CHECK-NEXT: %acc = phi
+; CHECK-NEXT: call void @weak_touch()
+; CHECK-NEXT: %g = load i32, i32* @G
+; CHECK-LABEL: define i32 @sum(
+; CHECK: entry:
+; CHECK-NEXT: %g = load i32, i32* @G
+; CHECK: loop:
+
+@G = global i32 0
+@H = global i32 0
+
+define weak void @weak_touch() {
+entry:
+  %h = load volatile i32, i32* @H
+  ret void
+}
+
+define void @touch() {
+entry:
+  %h = load volatile i32, i32* @H
+  ret void
+}
+
+define i32 @sum_weak(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  call void @weak_touch()
+  %g = load i32, i32* @G
+  %acc.next = add i32 %acc, %g
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i32 %acc.next
+}
+
+define i32 @sum(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  call void @touch()
+  %g = load i32, i32* @G
+  %acc.next = add i32 %acc, %g
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i32 %acc.next
+}
@@ -0,0 +1,75 @@
+; Serial and partitioned runs must write the same bitcode, byte for byte.
+
+@A = global [64 x i32] zeroinitializer
+@B = global [64 x i32] zeroinitializer
+@S = internal global i32 0
+
+define internal i32 @sum(i32* %p, i32 %n, i32 %k) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %scale = mul i32 %k, 3
+  %idx = sext i32 %i to i64
+  %addr = getelementptr i32, i32* %p, i64 %idx
+  %v = load i32, i32* %addr
+  %w = mul i32 %v, %scale
+  %acc.next = add i32 %acc, %w
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %exit
+
+exit:
+  ret i32 %acc.next
+}
+
+define void @count(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %s = load i32, i32* @S
+  %s.next = add i32 %s, %i
+  store i32 %s.next, i32* @S
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+define void @copy(i32 %n, i32 %off) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %base = getelementptr [64 x i32], [64 x i32]* @A, i64 0, i64 0
+  %o = sext i32 %off to i64
+  %src = getelementptr i32, i32* %base, i64 %o
+  %v = load i32, i32* %src
+  %idx = sext i32 %i to i64
+  %dst = getelementptr [64 x i32], [64 x i32]* @B, i64 0, i64 %idx
+  store i32 %v, i32* %dst
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+define i32 @main() {
+entry:
+  call void @copy(i32 64, i32 3)
+  call void @count(i32 10)
+  %p = getelementptr [64 x i32], [64 x i32]* @B, i64 0, i64 0
+  %r = call i32 @sum(i32* %p, i32 64, i32 2)
+  %s = load i32, i32* @S
+  %t = add i32 %r, %s
+  ret i32 %t
+}
@@ -0,0 +1,122 @@
+; -O0 style IR: the locals are frame addresses, not registers that the
+; loop keeps live, so the variable-index GEP is hoisted.
+
+define void @locals(i32* %p, i64 %k, i32 %n) {
+entry:
+  %v0 = alloca i32
+  %v1 = alloca i32
+  %v2 = alloca i32
+  %v3 = alloca i32
+  %v4 = alloca i32
+  %v5 = alloca i32
+  %v6 = alloca i32
+  %v7 = alloca i32
+  %v8 = alloca i32
+  %v9 = alloca i32
+  %v10 = alloca i32
+  %v11 = alloca i32
+  %v12 = alloca i32
+  %v13 = alloca i32
+  %v14 = alloca i32
+  %v15 = alloca i32
+  %v16 = alloca i32
+  %v17 = alloca i32
+  %v18 = alloca i32
+  %v19 = alloca i32
+  store i32 0, i32* %v0
+  store i32 1, i32* %v1
+  store i32 2, i32* %v2
+  store i32 3, i32* %v3
+  store i32 4, i32* %v4
+  store i32 5, i32* %v5
+  store i32 6, i32* %v6
+  store i32 7, i32* %v7
+  store i32 8, i32* %v8
+  store i32 9, i32* %v9
+  store i32 10, i32* %v10
+  store i32 11, i32* %v11
+  store i32 12, i32* %v12
+  store i32 13, i32* %v13
+  store i32 14, i32* %v14
+  store i32 15, i32* %v15
+  store i32 16, i32* %v16
+  store i32 17, i32* %v17
+  store i32 18, i32* %v18
+  store i32 19, i32* %v19
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %q = getelementptr i32, i32* %p, i64 %k
+  store i32 %i, i32* %q
+  %iz = zext i32 %i to i64
+  %km = mul i64 %k, %iz
+  %r = getelementptr i32, i32* %p, i64 %km
+  store i32 %i, i32* %r
+  %x0 = load i32, i32* %v0
+  %y0 = add i32 %x0, %i
+  store i32 %y0, i32* %v0
+  %x1 = load i32, i32* %v1
+  %y1 = add i32 %x1, %i
+  store i32 %y1, i32* %v1
+  %x2 = load i32, i32* %v2
+  %y2 = add i32 %x2, %i
+  store i32 %y2, i32* %v2
+  %x3 = load i32, i32* %v3
+  %y3 = add i32 %x3, %i
+  store i32 %y3, i32* %v3
+  %x4 = load i32, i32* %v4
+  %y4 = add i32 %x4, %i
+  store i32 %y4, i32* %v4
+  %x5 = load i32, i32* %v5
+  %y5 = add i32 %x5, %i
+  store i32 %y5, i32* %v5
+  %x6 = load i32, i32* %v6
+  %y6 = add i32 %x6, %i
+  store i32 %y6, i32* %v6
+  %x7 = load i32, i32* %v7
+  %y7 = add i32 %x7, %i
+  store i32 %y7, i32* %v7
+  %x8 = load i32, i32* %v8
+  %y8 = add i32 %x8, %i
+  store i32 %y8, i32* %v8
+  %x9 = load i32, i32* %v9
+  %y9 = add i32 %x9, %i
+  store i32 %y9, i32* %v9
+  %x10 = load i32, i32* %v10
+  %y10 = add i32 %x10, %i
+  store i32 %y10, i32* %v10
+  %x11 = load i32, i32* %v11
+  %y11 = add i32 %x11, %i
+  store i32 %y11, i32* %v11
+  %x12 = load i32, i32* %v12
+  %y12 = add i32 %x12, %i
+  store i32 %y12, i32* %v12
+  %x13 = load i32, i32* %v13
+  %y13 = add i32 %x13, %i
+  store i32 %y13, i32* %v13
+  %x14 = load i32, i32* %v14
+  %y14 = add i32 %x14, %i
+  store i32 %y14, i32* %v14
+  %x15 = load i32, i32* %v15
+  %y15 = add i32 %x15, %i
+  store i32 %y15, i32* %v15
+  %x16 = load i32, i32* %v16
+  %y16 = add i32 %x16, %i
+  store i32 %y16, i32* %v16
+  %x17 = load i32, i32* %v17
+  %y17 = add i32 %x17, %i
+  store i32 %y17, i32* %v17
+  %x18 = load i32, i32* %v18
+  %y18 = add i32 %x18, %i
+  store i32 %y18, i32* %v18
+  %x19 = load i32, i32* %v19
+  %y19 = add i32 %x19, %i
+  store i32 %y19, i32* %v19
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %exit
+
+exit:
+  ret void
+}
@@ -0,0 +1,80 @@
+; An invoke of an unknown function may read and write @g like a call does,
+; so @g is neither kept in a register across it nor loaded once before the
+; loop.
+
+; CHECK-LABEL: define void @count(
+; CHECK: loop:
+; CHECK-NEXT: %i = phi
+; CHECK-NEXT: %g = load i32, i32* @g
+; CHECK-NEXT: %g.next = add i32 %g, 1
+; CHECK-NEXT: store i32 %g.next, i32* @g
+; CHECK-NEXT: invoke void @bump()
+; CHECK: lpad:
+; CHECK-NOT: store
+; CHECK: resume
+; CHECK: exit:
+; CHECK-NEXT: ret void
+
+; CHECK-LABEL: define i32 @sum(
+; CHECK: loop:
+; CHECK-NEXT: %i = phi
+; CHECK-NEXT: %acc = phi
+; CHECK-NEXT: %h = load i32, i32* @h
+
+@g = global i32 0
+@h = global i32 0
+
+declare void @bump()
+declare i32 @__gxx_personality_v0(...)
+
+define void @count(i32 %n) personality i32 (...)* @__gxx_personality_v0 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %cont ]
+  %g = load i32, i32* @g
+  %g.next = add i32 %g, 1
+  store i32 %g.next, i32* @g
+  invoke void @bump()
+          to label %cont unwind label %lpad
+
+cont:
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+lpad:
+  %lp = landingpad { i8*, i32 }
+          cleanup
+  resume { i8*, i32 } %lp
+
+exit:
+  ret void
+}
+
+define i32 @sum(i32 %n) personality i32 (...)* @__gxx_personality_v0 {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %cont ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %cont ]
+  %h = load i32, i32* @h
+  %acc.next = add i32 %acc, %h
+  invoke void @bump()
+          to label %cont unwind label %lpad
+
+cont:
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+lpad:
+  %lp = landingpad { i8*, i32 }
+          cleanup
+  resume { i8*, i32 } %lp
+
+exit:
+  ret i32 %acc.next
+}
@@ -0,0 +1,43 @@
+; @G is promoted in the inner loop, which erases its load and store. The
+; outer loop is checked afterwards and must not look at them any more.
+
+; CHECK-LABEL: define void @nest(
+; CHECK: outer:
+; CHECK: %G.promoted = load i32, i32* @G
+; CHECK: inner:
+; CHECK-NOT: @G
+; CHECK: outer.latch:
+; CHECK-NEXT: store i32 %{{.*}}, i32* @G
+; CHECK: %h = load i32, i32* @H
+
+@G = global i32 0
+@H = global i32 0
+
+define void @nest(i32* %p, i32 %n) {
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  %x = load i32, i32* %p
+  br label %inner
+
+inner:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %inner ]
+  %g = load i32, i32* @G
+  %g.next = add i32 %g, %x
+  store i32 %g.next, i32* @G
+  %j.next = add i32 %j, 1
+  %inner.cond = icmp slt i32 %j.next, %n
+  br i1 %inner.cond, label %inner, label %outer.latch
+
+outer.latch:
+  %h = load i32, i32* @H
+  store i32 %h, i32* %p
+  %i.next = add i32 %i, 1
+  %outer.cond = icmp slt i32 %i.next, %n
+  br i1 %outer.cond, label %outer, label %exit
+
+exit:
+  ret void
+}
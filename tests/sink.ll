@@ -0,0 +1,45 @@
+; %sq, %t and the load of a[i] with its address are only used after the
+; loop, so they move into the exits and run once. %acc.next feeds the next
+; iteration and stays.
+
+; CHECK-LABEL: define i32 @last(
+; CHECK: loop:
+; CHECK-NOT: mul
+; CHECK-NOT: load
+; CHECK: %acc.next = add
+; CHECK: br i1 %c, label %loop, label %exit
+; CHECK: exit:
+; CHECK: %sq.le = mul i32
+; CHECK: %ai.le = getelementptr inbounds i32, i32* %a
+; CHECK: %v.le = load i32, i32* %ai.le
+; CHECK: done:
+; CHECK: %t.le = add i32
+
+define i32 @last(i32* %a, i32 %n, i1 %early) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %latch ]
+  %sq = mul i32 %i, %i
+  %idx = sext i32 %i to i64
+  %ai = getelementptr inbounds i32, i32* %a, i64 %idx
+  %v = load i32, i32* %ai
+  %t = add i32 %i, 7
+  br i1 %early, label %done, label %latch
+
+latch:
+  %acc.next = add i32 %acc, %i
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  %r = add i32 %sq, %v
+  %s = add i32 %r, %acc.next
+  ret i32 %s
+
+done:
+  ret i32 %t
+}
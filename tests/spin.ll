@@ -0,0 +1,61 @@
+; Atomic loads stronger than unordered wait for other threads and must stay
+; in the loop, even from a global that the loop does not store to.
+
+; CHECK-LABEL: define void @spin(
+; CHECK: loop:
+; CHECK-NEXT: %f = load atomic i32, i32* @flag seq_cst
+; CHECK-LABEL: define void @spin_acquire(
+; CHECK: loop:
+; CHECK-NEXT: %f = load atomic i32, i32* %flag acquire
+; CHECK-LABEL: define i32 @unordered(
+; CHECK: entry:
+; CHECK-NEXT: %f = load atomic i32, i32* @flag unordered
+; CHECK: loop:
+
+@flag = global i32 0
+
+define void @spin() {
+entry:
+  br label %loop
+
+loop:
+  %f = load atomic i32, i32* @flag seq_cst, align 4
+  %c = icmp eq i32 %f, 0
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+define void @spin_acquire() {
+entry:
+  %flag = alloca i32
+  store i32 0, i32* %flag
+  call void @publish(i32* %flag)
+  br label %loop
+
+loop:
+  %f = load atomic i32, i32* %flag acquire, align 4
+  %c = icmp eq i32 %f, 0
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret void
+}
+
+define i32 @unordered(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %f = load atomic i32, i32* @flag unordered, align 4
+  %i.next = add i32 %i, %f
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i32 %i.next
+}
+
+declare void @publish(i32*)
@@ -0,0 +1,136 @@
+; The exit branch on %stop is invariant and runs first on every iteration,
+; so it moves to the preheader although the header PHI is live after the
+; loop through the other exit.
+
+; CHECK-LABEL: define i32 @uns(
+; CHECK: entry:
+; CHECK-NEXT: br i1 %stop, label %stopped, label %[[PH:.*]]
+; CHECK: [[PH]]:
+; CHECK-NEXT: br label %loop
+; CHECK: loop:
+; CHECK-NOT: br i1 %stop
+; CHECK: done:
+; CHECK-NEXT: %r = phi i32 [ %i, %latch ]
+
+define i32 @uns(i32* %p, i32 %n, i1 %stop) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  br i1 %stop, label %stopped, label %latch
+
+latch:
+  %idx = sext i32 %i to i64
+  %addr = getelementptr i32, i32* %p, i64 %idx
+  store i32 %i, i32* %addr
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %done
+
+done:
+  %r = phi i32 [ %i, %latch ]
+  ret i32 %r
+
+stopped:
+  ret i32 -1
+}
+
+; Here the exit that would be unswitched gets the header PHI, which the
+; preheader does not have.
+
+; CHECK-LABEL: define i32 @uns_live(
+; CHECK: loop:
+; CHECK: br i1 %stop, label %stopped, label %latch
+
+define i32 @uns_live(i32* %p, i32 %n, i1 %stop) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  br i1 %stop, label %stopped, label %latch
+
+latch:
+  %idx = sext i32 %i to i64
+  %addr = getelementptr i32, i32* %p, i64 %idx
+  store i32 %i, i32* %addr
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %done
+
+done:
+  ret i32 %n
+
+stopped:
+  %s = phi i32 [ %i, %loop ]
+  ret i32 %s
+}
+
+; The header PHI is used directly after the exit that would be unswitched,
+; without an LCSSA PHI. Forming LCSSA gives it one, which keeps the branch.
+
+; CHECK-LABEL: define i32 @uns_direct(
+; CHECK: loop:
+; CHECK: br i1 %stop, label %stopped, label %latch
+; CHECK: stopped:
+; CHECK-NEXT: %[[S:i.lcssa.*]] = phi i32 [ %i, %loop ]
+; CHECK-NEXT: ret i32 %[[S]]
+
+define i32 @uns_direct(i32* %p, i32 %n, i1 %stop) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  br i1 %stop, label %stopped, label %latch
+
+latch:
+  %idx = sext i32 %i to i64
+  %addr = getelementptr i32, i32* %p, i64 %idx
+  store i32 %i, i32* %addr
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %done
+
+done:
+  ret i32 %n
+
+stopped:
+  ret i32 %i
+}
+
+; Used directly after the other exit, the header PHI does not stop the
+; branch from moving.
+
+; CHECK-LABEL: define i32 @uns_direct_other(
+; CHECK: entry:
+; CHECK-NEXT: br i1 %stop, label %stopped, label %[[PH:.*]]
+; CHECK: loop:
+; CHECK-NOT: br i1 %stop
+; CHECK: done:
+; CHECK-NEXT: %[[D:i.lcssa.*]] = phi i32 [ %i, %latch ]
+; CHECK-NEXT: ret i32 %[[D]]
+
+define i32 @uns_direct_other(i32* %p, i32 %n, i1 %stop) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  br i1 %stop, label %stopped, label %latch
+
+latch:
+  %idx = sext i32 %i to i64
+  %addr = getelementptr i32, i32* %p, i64 %idx
+  store i32 %i, i32* %addr
+  %i.next = add i32 %i, 1
+  %cond = icmp slt i32 %i.next, %n
+  br i1 %cond, label %loop, label %done
+
+done:
+  ret i32 %i
+
+stopped:
+  ret i32 -1
+}
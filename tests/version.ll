@@ -0,0 +1,34 @@
+; The store through %a keeps the load of %p in the loop unless the two do
+; not overlap. -licm-version checks that at run time: the checked copy
+; hoists the load, the clone that runs on overlap keeps it.
+
+; CHECK-LABEL: define void @scale(
+; CHECK: loop.lver.check:
+; CHECK: br i1 %found.conflict, label %loop.ph.lver.orig, label %loop.ph
+; CHECK: loop.lver.orig:
+; CHECK: load i32, i32* %p
+; CHECK: store i32
+; CHECK: loop.ph:
+; CHECK-NEXT: %k = load i32, i32* %p
+; CHECK: loop:
+; CHECK-NOT: load i32, i32* %p
+; CHECK: exit:
+
+define void @scale(i32* %a, i32* %p, i64 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %k = load i32, i32* %p
+  %ai = getelementptr inbounds i32, i32* %a, i64 %i
+  %v = load i32, i32* %ai
+  %m = mul i32 %v, %k
+  store i32 %m, i32* %ai
+  %i.next = add nuw nsw i64 %i, 1
+  %c = icmp slt i64 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret void
+}